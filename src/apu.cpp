@@ -0,0 +1,666 @@
+#include "apu.h"
+#include <math.h>
+
+// Bits that always read back as 1, NR10 through the unused 0xFF27-0xFF2F
+static const byte s_ReadMask[0x20] =
+{
+    0x80, 0x3F, 0x00, 0xFF, 0xBF,
+    0xFF, 0x3F, 0x00, 0xFF, 0xBF,
+    0x7F, 0xFF, 0x9F, 0xFF, 0xBF,
+    0xFF, 0xFF, 0x00, 0x00, 0xBF,
+    0x00, 0x00, 0x70,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
+};
+
+static const byte s_Duty[4][8] =
+{
+    { 0, 0, 0, 0, 0, 0, 0, 1 },     // 12.5%
+    { 1, 0, 0, 0, 0, 0, 0, 1 },     // 25%
+    { 1, 0, 0, 0, 0, 1, 1, 1 },     // 50%
+    { 0, 1, 1, 1, 1, 1, 1, 0 }      // 75%
+};
+
+static const byte s_NoiseDivisor[8] = { 8, 16, 32, 48, 64, 80, 96, 112 };
+
+// Per side the loudest mix is 4 channels * 15 * 8 master volume, keep that under int16
+#define OUTPUT_SCALE        60.0f
+// Leak on the integrator, a gentle high-pass that removes the DC of unipolar channels
+#define OUTPUT_LEAK         0.999f
+
+/*
+    Impulse kernels, one per sub-sample phase. Blackman windowed sinc, cut
+    off a little below Nyquist, each phase normalised so a step integrates
+    back to exactly its height.
+*/
+static float s_Kernel[BLIP_PHASES][BLIP_TAPS];
+
+static void BuildKernel()
+{
+    static bool built = false;
+    if (built)
+        return;
+
+    const double cutoff = 0.9;
+    for (int phase = 0; phase < BLIP_PHASES; phase++)
+    {
+        double sum = 0;
+        double center = BLIP_TAPS / 2 - 1 + (double)phase / BLIP_PHASES;
+        for (int tap = 0; tap < BLIP_TAPS; tap++)
+        {
+            double x = (tap - center) * cutoff;
+            double sinc = x == 0 ? 1.0 : sin(M_PI * x) / (M_PI * x);
+            double w = (tap - center + BLIP_TAPS / 2) / BLIP_TAPS;
+            double window = 0.42 - 0.5 * cos(2 * M_PI * w) + 0.08 * cos(4 * M_PI * w);
+            s_Kernel[phase][tap] = sinc * window;
+            sum += s_Kernel[phase][tap];
+        }
+        for (int tap = 0; tap < BLIP_TAPS; tap++)
+            s_Kernel[phase][tap] /= sum;
+    }
+    built = true;
+}
+
+APU::APU()
+{
+    BuildKernel();
+    m_Sink = NULL;
+    memset(m_Blip, 0, sizeof(m_Blip));
+    memset(m_Amp, 0, sizeof(m_Amp));
+    m_BlipOffset = 0;
+    Reset();
+}
+
+void APU::Reset()
+{
+    memset(&m_State, 0, sizeof(m_State));
+    m_State.Power           = true;
+    m_State.NextSequencer   = SEQUENCER_PERIOD;
+    m_State.Noise.LFSR      = 0x7FFF;
+}
+
+/*
+    Whatever is in the buffers has already been heard up to the frame start,
+    so it stays. If the loaded channels sit at different levels the change
+    goes in as an ordinary step, a rewind to the same levels adds nothing.
+*/
+void APU::Load(const APUState& state)
+{
+    m_State = state;
+    OutputAll(m_State.Time);
+}
+
+/*
+    Register access - catch the channels up first so the write lands at the
+    right moment
+*/
+byte APU::Read(word address, quadword time)
+{
+    RunUntil(time);
+
+    APUState& s = m_State;
+    if (address >= WAVE_RAM)
+        return s.Regs[address - APU_START];
+
+    if (address == REG_NR52)
+    {
+        return (s.Power << 7) | 0x70
+             | (s.Square[0].Enabled << 0)
+             | (s.Square[1].Enabled << 1)
+             | (s.Wave.Enabled      << 2)
+             | (s.Noise.Enabled     << 3);
+    }
+
+    return s.Regs[address - APU_START] | s_ReadMask[address - APU_START];
+}
+
+void APU::Write(word address, byte val, quadword time)
+{
+    RunUntil(time);
+
+    APUState& s = m_State;
+    if (address >= WAVE_RAM)
+    {
+        s.Regs[address - APU_START] = val;
+        return;
+    }
+
+    if (address == REG_NR52)
+    {
+        bool power = val & 0x80;
+        if (s.Power && !power)
+        {
+            // Powering off clears every register except wave RAM
+            memset(s.Regs, 0, WAVE_RAM - APU_START);
+            memset(s.Square, 0, sizeof(s.Square));
+            memset(&s.Wave, 0, sizeof(s.Wave));
+            memset(&s.Noise, 0, sizeof(s.Noise));
+            s.Noise.LFSR = 0x7FFF;
+        }
+        else if (!s.Power && power)
+        {
+            s.SequencerStep = 0;
+        }
+        s.Power = power;
+        OutputAll(time);
+        return;
+    }
+
+    // Everything else is ignored while powered off
+    if (!s.Power)
+        return;
+
+    s.Regs[address - APU_START] = val;
+    WriteChannel(address, val);
+
+    if (address == REG_NR50 || address == REG_NR51)
+        OutputAll(time);
+    else
+        Output((address - APU_START) / 5, time);
+}
+
+void APU::WriteChannel(word address, byte val)
+{
+    APUState& s = m_State;
+    int offset = address - APU_START;
+    int channel = offset / 5;
+    int reg = offset % 5;
+
+    if (channel < 2)
+    {
+        SquareChannel& sq = s.Square[channel];
+        switch (reg)
+        {
+            case 0:
+                sq.SweepPeriod  = (val >> 4) & 0x07;
+                sq.SweepDown    = val & 0x08;
+                sq.SweepShift   = val & 0x07;
+                break;
+            case 1:
+                sq.Duty         = val >> 6;
+                sq.Length       = 64 - (val & 0x3F);
+                break;
+            case 2:
+                sq.Env.Initial  = val >> 4;
+                sq.Env.Up       = val & 0x08;
+                sq.Env.Period   = val & 0x07;
+                sq.DAC          = val & 0xF8;
+                if (!sq.DAC)
+                    sq.Enabled = false;
+                break;
+            case 3:
+                sq.Freq = (sq.Freq & 0x700) | val;
+                break;
+            case 4:
+                sq.Freq = (sq.Freq & 0xFF) | ((val & 0x07) << 8);
+                sq.LengthEnable = val & 0x40;
+                if (val & 0x80)
+                    Trigger(channel);
+                break;
+        }
+    }
+    else if (channel == 2)
+    {
+        WaveChannel& wave = s.Wave;
+        switch (reg)
+        {
+            case 0:
+                wave.DAC = val & 0x80;
+                if (!wave.DAC)
+                    wave.Enabled = false;
+                break;
+            case 1: wave.Length = 256 - val;             break;
+            case 2: wave.VolumeCode = (val >> 5) & 0x03; break;
+            case 3: wave.Freq = (wave.Freq & 0x700) | val; break;
+            case 4:
+                wave.Freq = (wave.Freq & 0xFF) | ((val & 0x07) << 8);
+                wave.LengthEnable = val & 0x40;
+                if (val & 0x80)
+                    Trigger(2);
+                break;
+        }
+    }
+    else if (channel == 3)
+    {
+        // Noise registers start one byte later, at 0xFF20
+        NoiseChannel& noise = s.Noise;
+        switch (reg)
+        {
+            case 1: noise.Length = 64 - (val & 0x3F); break;
+            case 2:
+                noise.Env.Initial  = val >> 4;
+                noise.Env.Up       = val & 0x08;
+                noise.Env.Period   = val & 0x07;
+                noise.DAC          = val & 0xF8;
+                if (!noise.DAC)
+                    noise.Enabled = false;
+                break;
+            case 3:
+                noise.ClockShift   = val >> 4;
+                noise.Narrow       = val & 0x08;
+                noise.Divisor      = val & 0x07;
+                break;
+            case 4:
+                noise.LengthEnable = val & 0x40;
+                if (val & 0x80)
+                    Trigger(3);
+                break;
+        }
+    }
+}
+
+void APU::Trigger(int channel)
+{
+    APUState& s = m_State;
+    if (channel < 2)
+    {
+        SquareChannel& sq = s.Square[channel];
+        sq.Enabled      = sq.DAC;
+        if (sq.Length == 0)
+            sq.Length = 64;
+        sq.Timer        = (2048 - sq.Freq) * 4;
+        sq.Env.Volume   = sq.Env.Initial;
+        sq.Env.Timer    = sq.Env.Period;
+
+        if (channel == 0)
+        {
+            sq.SweepFreq    = sq.Freq;
+            sq.SweepTimer   = sq.SweepPeriod ? sq.SweepPeriod : 8;
+            sq.SweepEnabled = sq.SweepPeriod || sq.SweepShift;
+            if (sq.SweepShift && !sq.SweepDown && sq.Freq + (sq.Freq >> sq.SweepShift) > 2047)
+                sq.Enabled = false;
+        }
+    }
+    else if (channel == 2)
+    {
+        WaveChannel& wave = s.Wave;
+        wave.Enabled    = wave.DAC;
+        if (wave.Length == 0)
+            wave.Length = 256;
+        wave.Timer      = (2048 - wave.Freq) * 2;
+        wave.Position   = 0;
+    }
+    else
+    {
+        NoiseChannel& noise = s.Noise;
+        noise.Enabled   = noise.DAC;
+        if (noise.Length == 0)
+            noise.Length = 64;
+        noise.Timer     = s_NoiseDivisor[noise.Divisor] << noise.ClockShift;
+        noise.LFSR      = 0x7FFF;
+        noise.Env.Volume = noise.Env.Initial;
+        noise.Env.Timer = noise.Env.Period;
+    }
+}
+
+/*
+    Catch up to time - channels run in stretches between frame sequencer ticks
+*/
+void APU::RunUntil(quadword time)
+{
+    APUState& s = m_State;
+    while (s.Time < time)
+    {
+        quadword end = time < s.NextSequencer ? time : s.NextSequencer;
+
+        RunSquare(0, s.Time, end);
+        RunSquare(1, s.Time, end);
+        RunWave(s.Time, end);
+        RunNoise(s.Time, end);
+        s.Time = end;
+
+        if (end == s.NextSequencer)
+        {
+            ClockSequencer();
+            s.NextSequencer += SEQUENCER_PERIOD;
+            OutputAll(end);
+        }
+    }
+}
+
+void APU::RunSquare(int index, quadword from, quadword to)
+{
+    SquareChannel& sq = m_State.Square[index];
+    int period = (2048 - sq.Freq) * 4;
+    quadword t = from;
+
+    // Silent channels still step their duty position, just without output
+    if (!sq.Enabled || sq.Env.Volume == 0 || !m_Sink)
+    {
+        quadword elapsed = to - from;
+        if (elapsed < (quadword)sq.Timer)
+        {
+            sq.Timer -= elapsed;
+            return;
+        }
+        elapsed -= sq.Timer;
+        sq.Phase = (sq.Phase + 1 + elapsed / period) & 7;
+        sq.Timer = period - elapsed % period;
+        return;
+    }
+
+    int gain[2];
+    Gains(index, gain);
+    const byte* duty = s_Duty[sq.Duty];
+
+    while (t + sq.Timer <= to)
+    {
+        t += sq.Timer;
+        sq.Timer = period;
+        sq.Phase = (sq.Phase + 1) & 7;
+        Emit(index, t, duty[sq.Phase] ? sq.Env.Volume : 0, gain);
+    }
+    sq.Timer -= to - t;
+}
+
+void APU::RunWave(quadword from, quadword to)
+{
+    WaveChannel& wave = m_State.Wave;
+    int period = (2048 - wave.Freq) * 2;
+    quadword t = from;
+
+    if (!wave.Enabled || wave.VolumeCode == 0 || !m_Sink)
+    {
+        quadword elapsed = to - from;
+        if (elapsed < (quadword)wave.Timer)
+        {
+            wave.Timer -= elapsed;
+            return;
+        }
+        elapsed -= wave.Timer;
+        wave.Position = (wave.Position + 1 + elapsed / period) & 31;
+        wave.Timer = period - elapsed % period;
+        return;
+    }
+
+    int gain[2];
+    Gains(2, gain);
+
+    while (t + wave.Timer <= to)
+    {
+        t += wave.Timer;
+        wave.Timer = period;
+        wave.Position = (wave.Position + 1) & 31;
+        Emit(2, t, Level(2), gain);
+    }
+    wave.Timer -= to - t;
+}
+
+void APU::RunNoise(quadword from, quadword to)
+{
+    NoiseChannel& noise = m_State.Noise;
+    int period = s_NoiseDivisor[noise.Divisor] << noise.ClockShift;
+    quadword t = from;
+
+    // Only an audible channel needs its LFSR stepped, a trigger reseeds it
+    // anyway. Shifts of 14 and 15 never clock it at all.
+    if (!noise.Enabled || !m_Sink || noise.ClockShift >= 14)
+    {
+        quadword elapsed = to - from;
+        if (elapsed < (quadword)noise.Timer)
+        {
+            noise.Timer -= elapsed;
+            return;
+        }
+        elapsed -= noise.Timer;
+        noise.Timer = period - elapsed % period;
+        return;
+    }
+
+    int gain[2];
+    Gains(3, gain);
+
+    while (t + noise.Timer <= to)
+    {
+        t += noise.Timer;
+        noise.Timer = period;
+
+        word bit = (noise.LFSR ^ (noise.LFSR >> 1)) & 1;
+        noise.LFSR = (noise.LFSR >> 1) | (bit << 14);
+        if (noise.Narrow)
+            noise.LFSR = (noise.LFSR & ~(1 << 6)) | (bit << 6);
+
+        Emit(3, t, (~noise.LFSR & 1) ? noise.Env.Volume : 0, gain);
+    }
+    noise.Timer -= to - t;
+}
+
+static void ClockEnvelope(Envelope& env)
+{
+    if (env.Period == 0)
+        return;
+    if (env.Timer > 0 && --env.Timer > 0)
+        return;
+
+    env.Timer = env.Period;
+    if (env.Up && env.Volume < 15)
+        env.Volume++;
+    else if (!env.Up && env.Volume > 0)
+        env.Volume--;
+}
+
+/*
+    Steps 0,2,4,6 clock length, 2 and 6 the sweep, 7 the envelopes
+*/
+void APU::ClockSequencer()
+{
+    APUState& s = m_State;
+    byte step = s.SequencerStep;
+    s.SequencerStep = (step + 1) & 7;
+
+    if (!s.Power)
+        return;
+
+    if ((step & 1) == 0)
+    {
+        for (int i = 0; i < 2; i++)
+        {
+            if (s.Square[i].LengthEnable && s.Square[i].Length > 0 && --s.Square[i].Length == 0)
+                s.Square[i].Enabled = false;
+        }
+        if (s.Wave.LengthEnable && s.Wave.Length > 0 && --s.Wave.Length == 0)
+            s.Wave.Enabled = false;
+        if (s.Noise.LengthEnable && s.Noise.Length > 0 && --s.Noise.Length == 0)
+            s.Noise.Enabled = false;
+    }
+
+    if (step == 2 || step == 6)
+    {
+        SquareChannel& sq = s.Square[0];
+        if (sq.SweepEnabled && --sq.SweepTimer == 0)
+        {
+            sq.SweepTimer = sq.SweepPeriod ? sq.SweepPeriod : 8;
+            if (sq.SweepPeriod)
+            {
+                word delta = sq.SweepFreq >> sq.SweepShift;
+                word freq = sq.SweepDown ? sq.SweepFreq - delta : sq.SweepFreq + delta;
+                if (freq > 2047)
+                {
+                    sq.Enabled = false;
+                }
+                else if (sq.SweepShift)
+                {
+                    sq.SweepFreq = freq;
+                    sq.Freq = freq;
+                }
+            }
+        }
+    }
+
+    if (step == 7)
+    {
+        ClockEnvelope(s.Square[0].Env);
+        ClockEnvelope(s.Square[1].Env);
+        ClockEnvelope(s.Noise.Env);
+    }
+}
+
+/*
+    Current 0-15 output of a channel before panning and master volume
+*/
+int APU::Level(int channel) const
+{
+    const APUState& s = m_State;
+    switch (channel)
+    {
+        case 0:
+        case 1:
+        {
+            const SquareChannel& sq = s.Square[channel];
+            if (!sq.Enabled)
+                return 0;
+            return s_Duty[sq.Duty][sq.Phase] ? sq.Env.Volume : 0;
+        }
+        case 2:
+        {
+            const WaveChannel& wave = s.Wave;
+            if (!wave.Enabled || wave.VolumeCode == 0)
+                return 0;
+            byte sample = s.Regs[WAVE_RAM - APU_START + wave.Position / 2];
+            sample = (wave.Position & 1) ? (sample & 0x0F) : (sample >> 4);
+            return sample >> (wave.VolumeCode - 1);
+        }
+        case 3:
+        {
+            const NoiseChannel& noise = s.Noise;
+            if (!noise.Enabled)
+                return 0;
+            return (~noise.LFSR & 1) ? noise.Env.Volume : 0;
+        }
+    }
+    return 0;
+}
+
+/*
+    Per side multiplier for a channel - NR51 routes it (low nibble right,
+    high nibble left) and NR50 sets each side's master volume
+*/
+void APU::Gains(int channel, int gain[2]) const
+{
+    byte nr50 = m_State.Regs[REG_NR50 - APU_START];
+    byte nr51 = m_State.Regs[REG_NR51 - APU_START];
+
+    for (int side = 0; side < 2; side++)
+    {
+        int shift = side == 0 ? 4 : 0;
+        gain[side] = (nr51 & (1 << (channel + shift))) ? ((nr50 >> shift) & 0x07) + 1 : 0;
+    }
+}
+
+/*
+    Only changes in level turn into impulses. An evenly panned channel
+    only needs the one impulse in the center buffer.
+*/
+void APU::Emit(int channel, quadword time, int level, const int gain[2])
+{
+    int amp[BLIP_COUNT];
+    if (gain[0] == gain[1])
+    {
+        amp[BLIP_LEFT]   = 0;
+        amp[BLIP_RIGHT]  = 0;
+        amp[BLIP_CENTER] = level * gain[0];
+    }
+    else
+    {
+        amp[BLIP_LEFT]   = level * gain[0];
+        amp[BLIP_RIGHT]  = level * gain[1];
+        amp[BLIP_CENTER] = 0;
+    }
+
+    int* last = m_Amp[channel];
+    for (int side = 0; side < BLIP_COUNT; side++)
+    {
+        if (amp[side] != last[side])
+        {
+            AddDelta(m_Blip[side], time, amp[side] - last[side]);
+            last[side] = amp[side];
+        }
+    }
+}
+
+void APU::Output(int channel, quadword time)
+{
+    if (channel > 3 || !m_Sink)
+        return;
+
+    int gain[2];
+    Gains(channel, gain);
+    Emit(channel, time, m_State.Power ? Level(channel) : 0, gain);
+}
+
+void APU::OutputAll(quadword time)
+{
+    for (int channel = 0; channel < 4; channel++)
+        Output(channel, time);
+}
+
+void APU::AddDelta(BlipBuffer& blip, quadword time, int delta)
+{
+    quadword pos = m_BlipOffset + (time - m_State.FrameStart) * BLIP_FACTOR;
+    quadword index = pos >> 32;
+    if (index + BLIP_TAPS > BLIP_SIZE)
+        return;
+
+    const float* kernel = s_Kernel[(pos >> (32 - BLIP_PHASE_BITS)) & (BLIP_PHASES - 1)];
+    float* out = &blip.Samples[index];
+    for (int tap = 0; tap < BLIP_TAPS; tap++)
+        out[tap] += kernel[tap] * delta;
+}
+
+static inline int16_t Clamp(float sample)
+{
+    if (sample > 32767.0f)  return 32767;
+    if (sample < -32768.0f) return -32768;
+    return (int16_t)sample;
+}
+
+/*
+    Close out the frame and hand its samples to the sink as one buffer
+*/
+void APU::EndFrame(quadword time)
+{
+    RunUntil(time);
+
+    APUState& s = m_State;
+    quadword clocks = time - s.FrameStart;
+    s.FrameStart = time;
+
+    // Nothing was added without a sink, the buffers just wait for one
+    if (!m_Sink)
+        return;
+
+    m_BlipOffset += clocks * BLIP_FACTOR;
+
+    int count = m_BlipOffset >> 32;
+    if (count > AUDIO_BUFFER_FRAMES)
+        count = AUDIO_BUFFER_FRAMES;
+
+    AudioBuffer* buffer = m_Sink->AcquireAudio();
+    buffer->Frames = count;
+
+    float left   = m_Blip[BLIP_LEFT].Integrator;
+    float right  = m_Blip[BLIP_RIGHT].Integrator;
+    float center = m_Blip[BLIP_CENTER].Integrator;
+    for (int i = 0; i < count; i++)
+    {
+        left   = left   * OUTPUT_LEAK + m_Blip[BLIP_LEFT].Samples[i];
+        right  = right  * OUTPUT_LEAK + m_Blip[BLIP_RIGHT].Samples[i];
+        center = center * OUTPUT_LEAK + m_Blip[BLIP_CENTER].Samples[i];
+
+        buffer->Samples[i * AUDIO_CHANNELS]     = Clamp((left + center) * OUTPUT_SCALE);
+        buffer->Samples[i * AUDIO_CHANNELS + 1] = Clamp((right + center) * OUTPUT_SCALE);
+    }
+    m_Blip[BLIP_LEFT].Integrator   = left;
+    m_Blip[BLIP_RIGHT].Integrator  = right;
+    m_Blip[BLIP_CENTER].Integrator = center;
+
+    // Impulse tails that spill past this frame move to the front
+    for (int side = 0; side < BLIP_COUNT; side++)
+    {
+        BlipBuffer& blip = m_Blip[side];
+        memmove(blip.Samples, &blip.Samples[count], (BLIP_SIZE - count) * sizeof(float));
+        memset(&blip.Samples[BLIP_SIZE - count], 0, count * sizeof(float));
+    }
+    m_BlipOffset -= (quadword)count << 32;
+
+    m_Sink->SubmitAudio(buffer);
+}
@@ -0,0 +1,182 @@
+#pragma once
+#include "memory.h"
+#include "audio.h"
+
+// Sound registers NR10-NR52 and wave RAM
+#define APU_START           0xFF10
+#define APU_END             0xFF3F
+#define REG_NR10            0xFF10
+#define REG_NR14            0xFF14
+#define REG_NR24            0xFF19
+#define REG_NR30            0xFF1A
+#define REG_NR34            0xFF1E
+#define REG_NR44            0xFF23
+#define REG_NR50            0xFF24
+#define REG_NR51            0xFF25
+#define REG_NR52            0xFF26
+#define WAVE_RAM            0xFF30
+
+#define CPU_CLOCK           4194304
+// Frame sequencer runs at 512Hz
+#define SEQUENCER_PERIOD    (CPU_CLOCK / 512)
+
+/*
+  BAND-LIMITED SYNTHESIS:
+  Channels don't produce samples, they report the moment their output level
+  changes. Each change is added to the buffer as a windowed-sinc impulse at
+  its exact sub-sample position, and the buffer is integrated when the frame
+  is read out - so the steps come out band-limited instead of aliasing.
+*/
+#define BLIP_TAPS           16
+#define BLIP_PHASE_BITS     5
+#define BLIP_PHASES         (1 << BLIP_PHASE_BITS)
+#define BLIP_SIZE           (AUDIO_BUFFER_FRAMES + BLIP_TAPS)
+// Output samples per CPU cycle in 32.32 fixed point, exact since the clock is 2^22
+#define BLIP_FACTOR         (((quadword)AUDIO_SAMPLE_RATE << 32) / CPU_CLOCK)
+
+// Channels panned evenly go to the center buffer alone, which halves the work
+enum BlipSides
+{
+    BLIP_LEFT,
+    BLIP_RIGHT,
+    BLIP_CENTER,
+    BLIP_COUNT
+};
+
+typedef struct BlipBuffer
+{
+    float       Integrator;
+    float       Samples[BLIP_SIZE];
+} BlipBuffer;
+
+typedef struct Envelope
+{
+    byte        Initial;
+    bool        Up;
+    byte        Period;
+    byte        Volume;
+    byte        Timer;
+} Envelope;
+
+/*
+  Channel 1 and 2 - channel 2 just never has its sweep enabled
+*/
+typedef struct SquareChannel
+{
+    bool        Enabled;
+    bool        DAC;
+    byte        Duty;
+    byte        Phase;
+    word        Freq;
+    int         Timer;
+    int         Length;
+    bool        LengthEnable;
+    Envelope    Env;
+
+    bool        SweepEnabled;
+    byte        SweepPeriod;
+    bool        SweepDown;
+    byte        SweepShift;
+    byte        SweepTimer;
+    word        SweepFreq;
+} SquareChannel;
+
+typedef struct WaveChannel
+{
+    bool        Enabled;
+    bool        DAC;
+    byte        VolumeCode;
+    byte        Position;
+    word        Freq;
+    int         Timer;
+    int         Length;
+    bool        LengthEnable;
+} WaveChannel;
+
+typedef struct NoiseChannel
+{
+    bool        Enabled;
+    bool        DAC;
+    byte        ClockShift;
+    byte        Divisor;
+    bool        Narrow;
+    word        LFSR;
+    int         Timer;
+    int         Length;
+    bool        LengthEnable;
+    Envelope    Env;
+} NoiseChannel;
+
+/*
+  APU STATE:
+  Plain data so it can ride along in CPUState snapshots. Times are in CPU
+  cycles on the same clock as CPU::m_Cycles. The synthesis buffers aren't
+  part of it - they hold output, not machine state, and are far bigger than
+  everything else here.
+*/
+typedef struct APUState
+{
+    bool            Power;
+    byte            Regs[APU_END - APU_START + 1];
+
+    SquareChannel   Square[2];
+    WaveChannel     Wave;
+    NoiseChannel    Noise;
+
+    quadword        Time;           // Channels have been run up to here
+    quadword        FrameStart;
+    quadword        NextSequencer;
+    byte            SequencerStep;
+} APUState;
+
+/*
+  APU:
+  Nothing happens per cycle. Channels are only run forward when a sound
+  register is read or written and at the end of a frame, which is also when
+  the frame's samples are handed to the sink in one batch.
+*/
+class APU
+{
+    public:
+                                    APU             ();
+        void                        Reset           ();
+
+        byte                        Read            (word address, quadword time);
+        void                        Write           (word address, byte val, quadword time);
+        void                        EndFrame        (quadword time);
+
+        // NULL skips synthesis entirely, channel state is still kept
+        void                        SetSink         (AudioSink* sink) { m_Sink = sink; }
+        AudioSink*                  GetSink         () const { return m_Sink; }
+
+        void                        Save            (APUState& state) const { state = m_State; }
+        // The buffers carry on from where they are, only the channel levels get resent
+        void                        Load            (const APUState& state);
+
+    private:
+        APUState                    m_State;
+        AudioSink*                  m_Sink;
+
+        // Synthesis, kept out of snapshots
+        BlipBuffer                  m_Blip[BLIP_COUNT];
+        quadword                    m_BlipOffset;   // 32.32 position of the frame start in the buffers
+        // Level last sent to each buffer for each channel
+        int                         m_Amp[4][BLIP_COUNT];
+
+        void                        RunUntil        (quadword time);
+        void                        RunSquare       (int index, quadword from, quadword to);
+        void                        RunWave         (quadword from, quadword to);
+        void                        RunNoise        (quadword from, quadword to);
+        void                        ClockSequencer  ();
+
+        void                        Trigger         (int channel);
+        void                        WriteChannel    (word address, byte val);
+
+        // Output levels
+        int                         Level           (int channel) const;
+        void                        Gains           (int channel, int gain[2]) const;
+        void                        Emit            (int channel, quadword time, int level, const int gain[2]);
+        void                        Output          (int channel, quadword time);
+        void                        OutputAll       (quadword time);
+        void                        AddDelta        (BlipBuffer& blip, quadword time, int delta);
+};
@@ -0,0 +1,40 @@
+#pragma once
+#include "memory.h"
+
+// Audio is 16-bit stereo, one buffer holds a frame's worth with room to spare
+#define AUDIO_SAMPLE_RATE       48000
+#define AUDIO_CHANNELS          2
+#define AUDIO_BUFFER_FRAMES     1024
+
+typedef struct AudioBuffer
+{
+    int16_t     Samples[AUDIO_BUFFER_FRAMES * AUDIO_CHANNELS];
+    int         Frames;
+} AudioBuffer;
+
+/*
+  AUDIO SINK:
+  Where the APU sends a frame's worth of samples. Acquire hands out an empty
+  buffer, Submit passes it on - for the file sink that's a lock-free queue
+  to its writer thread.
+*/
+class AudioSink
+{
+    public:
+        virtual                     ~AudioSink      () {}
+        virtual AudioBuffer*        AcquireAudio    () = 0;
+        virtual void                SubmitAudio     (AudioBuffer* buffer) = 0;
+};
+
+/*
+  Throws everything away, for headless runs that still want the APU working
+*/
+class NullAudioSink : public AudioSink
+{
+    public:
+        AudioBuffer*                AcquireAudio    () override { return &m_Buffer; }
+        void                        SubmitAudio     (AudioBuffer*) override {}
+
+    private:
+        AudioBuffer                 m_Buffer;
+};
@@ -0,0 +1,207 @@
+#include "capture.h"
+#include <unistd.h>
+
+// Big stdio buffers so the writer mostly does large sequential writes
+#define CAPTURE_FILE_BUFFER     (1 << 20)
+// Every wake-up of the writer is a context switch the emulation pays for on a busy core
+#define CAPTURE_WRITER_NAP      2000
+
+Capture::Capture()
+{
+    m_Running       = false;
+    m_Stalls        = 0;
+    m_VideoFile     = NULL;
+    m_AudioFile     = NULL;
+    m_Y4M           = false;
+    m_AudioBytes    = 0;
+
+    for (int i = 0; i < CAPTURE_FRAME_BUFFERS; i++)
+        m_FreeFrames.Push(&m_Frames[i]);
+    for (int i = 0; i < CAPTURE_AUDIO_BUFFERS; i++)
+        m_FreeAudio.Push(&m_Audio[i]);
+}
+
+Capture::~Capture()
+{
+    Close();
+}
+
+static bool EndsWith(const std::string& str, const std::string& suffix)
+{
+    return str.size() >= suffix.size() && str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+bool Capture::Open(const std::string videoFile, const std::string audioFile)
+{
+    if (!videoFile.empty())
+    {
+        m_VideoFile = fopen(videoFile.c_str(), "wb");
+        if (m_VideoFile == NULL)
+        {
+            perror("Video Capture Open Failed:");
+            return false;
+        }
+        setvbuf(m_VideoFile, NULL, _IOFBF, CAPTURE_FILE_BUFFER);
+
+        // Anything that isn't .y4m gets bare greyscale frames back to back
+        m_Y4M = EndsWith(videoFile, ".y4m");
+        if (m_Y4M)
+            fprintf(m_VideoFile, "YUV4MPEG2 W%d H%d F%d:%d Ip A1:1 Cmono\n",
+                    SCREEN_WIDTH, SCREEN_HEIGHT, VIDEO_RATE_NUM, VIDEO_RATE_DEN);
+    }
+
+    if (!audioFile.empty())
+    {
+        m_AudioFile = fopen(audioFile.c_str(), "wb");
+        if (m_AudioFile == NULL)
+        {
+            perror("Audio Capture Open Failed:");
+            // The writer never started, so the video file is still ours to close
+            if (m_VideoFile)
+            {
+                fclose(m_VideoFile);
+                m_VideoFile = NULL;
+            }
+            return false;
+        }
+        setvbuf(m_AudioFile, NULL, _IOFBF, CAPTURE_FILE_BUFFER);
+
+        // Sizes get patched in on Close
+        WriteWavHeader();
+    }
+
+    m_Running = true;
+    m_Writer = std::thread(&Capture::WriterLoop, this);
+    return true;
+}
+
+void Capture::Close()
+{
+    if (m_Running)
+    {
+        m_Running.store(false, std::memory_order_release);
+        m_Writer.join();
+    }
+
+    if (m_VideoFile)
+    {
+        fclose(m_VideoFile);
+        m_VideoFile = NULL;
+    }
+    if (m_AudioFile)
+    {
+        fseek(m_AudioFile, 0, SEEK_SET);
+        WriteWavHeader();
+        fclose(m_AudioFile);
+        m_AudioFile = NULL;
+    }
+}
+
+byte* Capture::AcquireFrame()
+{
+    FrameBuffer* frame;
+    if (!m_FreeFrames.Pop(frame))
+    {
+        m_Stalls++;
+        while (!m_FreeFrames.Pop(frame))
+            std::this_thread::yield();
+    }
+    return frame->Pixels;
+}
+
+void Capture::SubmitFrame(byte* pixels)
+{
+    // Pixels is the first member, so this is the buffer AcquireFrame handed out
+    m_FullFrames.Push((FrameBuffer*)pixels);
+}
+
+AudioBuffer* Capture::AcquireAudio()
+{
+    AudioBuffer* buffer;
+    if (!m_FreeAudio.Pop(buffer))
+    {
+        m_Stalls++;
+        while (!m_FreeAudio.Pop(buffer))
+            std::this_thread::yield();
+    }
+    buffer->Frames = 0;
+    return buffer;
+}
+
+void Capture::SubmitAudio(AudioBuffer* buffer)
+{
+    m_FullAudio.Push(buffer);
+}
+
+/*
+    Writer thread - drains both queues, naps when there's nothing to do
+*/
+void Capture::WriterLoop()
+{
+    while (true)
+    {
+        // Read before draining so everything submitted before Close is seen
+        bool stopping = !m_Running.load(std::memory_order_acquire);
+        bool idle = true;
+
+        FrameBuffer* frame;
+        while (m_FullFrames.Pop(frame))
+        {
+            if (m_VideoFile)
+            {
+                if (m_Y4M)
+                    fputs("FRAME\n", m_VideoFile);
+                fwrite(frame->Pixels, 1, SCREEN_SIZE, m_VideoFile);
+            }
+            m_FreeFrames.Push(frame);
+            idle = false;
+        }
+
+        AudioBuffer* buffer;
+        while (m_FullAudio.Pop(buffer))
+        {
+            if (m_AudioFile)
+            {
+                size_t bytes = buffer->Frames * AUDIO_CHANNELS * sizeof(int16_t);
+                fwrite(buffer->Samples, 1, bytes, m_AudioFile);
+                m_AudioBytes += bytes;
+            }
+            m_FreeAudio.Push(buffer);
+            idle = false;
+        }
+
+        if (idle)
+        {
+            if (stopping)
+                break;
+            usleep(CAPTURE_WRITER_NAP);
+        }
+    }
+}
+
+/*
+    44 byte PCM header, little endian
+*/
+static void PutLE(FILE* fp, doubleword val, int bytes)
+{
+    for (int i = 0; i < bytes; i++)
+        fputc((val >> (i * 8)) & 0xFF, fp);
+}
+
+void Capture::WriteWavHeader()
+{
+    doubleword blockAlign = AUDIO_CHANNELS * sizeof(int16_t);
+
+    fwrite("RIFF", 1, 4, m_AudioFile);
+    PutLE(m_AudioFile, 36 + m_AudioBytes, 4);
+    fwrite("WAVEfmt ", 1, 8, m_AudioFile);
+    PutLE(m_AudioFile, 16, 4);                                  // fmt chunk size
+    PutLE(m_AudioFile, 1, 2);                                   // PCM
+    PutLE(m_AudioFile, AUDIO_CHANNELS, 2);
+    PutLE(m_AudioFile, AUDIO_SAMPLE_RATE, 4);
+    PutLE(m_AudioFile, AUDIO_SAMPLE_RATE * blockAlign, 4);      // byte rate
+    PutLE(m_AudioFile, blockAlign, 2);
+    PutLE(m_AudioFile, 16, 2);                                  // bits per sample
+    fwrite("data", 1, 4, m_AudioFile);
+    PutLE(m_AudioFile, m_AudioBytes, 4);
+}
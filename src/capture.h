@@ -0,0 +1,76 @@
+#pragma once
+#include <thread>
+#include "cpu.h"
+#include "spsc.h"
+#include "audio.h"
+
+// Enough for the writer to nap a couple of milliseconds while emulation runs unthrottled
+#define CAPTURE_FRAME_BUFFERS   32
+#define CAPTURE_AUDIO_BUFFERS   32
+
+// Frame rate as a fraction, CPU clock over cycles per frame (~59.73 fps)
+#define VIDEO_RATE_NUM          4194304
+#define VIDEO_RATE_DEN          CYCLES_PER_FRAME
+
+typedef struct FrameBuffer
+{
+    byte        Pixels[SCREEN_SIZE];
+} FrameBuffer;
+
+/*
+  CAPTURE:
+  Streams frames to a Y4M (or raw greyscale) file and audio to a WAV file
+  from a background writer thread. All buffers come from fixed pools - the
+  emulation thread renders straight into an acquired buffer and hands it
+  over through a lock-free queue, the writer hands it back the same way once
+  it's on disk. Nothing is allocated, copied or printed on the emulation side.
+
+  If the writer falls behind and the pool runs dry, Acquire waits for a
+  buffer rather than dropping the frame - recordings must be complete.
+
+  As an AudioSink it's the file sink for the APU.
+*/
+class Capture : public AudioSink
+{
+    public:
+                                    Capture         ();
+                                    ~Capture        ();
+
+        // Either name may be empty to skip that stream
+        bool                        Open            (const std::string videoFile, const std::string audioFile);
+        // Waits for everything submitted to be written
+        void                        Close           ();
+
+        byte*                       AcquireFrame    ();
+        void                        SubmitFrame     (byte* pixels);
+
+        AudioBuffer*                AcquireAudio    () override;
+        void                        SubmitAudio     (AudioBuffer* buffer) override;
+
+        // Acquires that found the pool empty and had to wait on the writer
+        quadword                    GetStalls       () const { return m_Stalls; }
+
+    private:
+        FrameBuffer                 m_Frames[CAPTURE_FRAME_BUFFERS];
+        AudioBuffer                 m_Audio[CAPTURE_AUDIO_BUFFERS];
+
+        // Emulation -> writer
+        SPSCQueue<FrameBuffer*, CAPTURE_FRAME_BUFFERS> m_FullFrames;
+        SPSCQueue<AudioBuffer*, CAPTURE_AUDIO_BUFFERS> m_FullAudio;
+        // Writer -> emulation
+        SPSCQueue<FrameBuffer*, CAPTURE_FRAME_BUFFERS> m_FreeFrames;
+        SPSCQueue<AudioBuffer*, CAPTURE_AUDIO_BUFFERS> m_FreeAudio;
+
+        std::thread                 m_Writer;
+        std::atomic<bool>           m_Running;
+        quadword                    m_Stalls;
+
+        // Only touched by the writer thread once it's started
+        FILE*                       m_VideoFile;
+        FILE*                       m_AudioFile;
+        bool                        m_Y4M;
+        quadword                    m_AudioBytes;
+
+        void                        WriterLoop      ();
+        void                        WriteWavHeader  ();
+};
@@ -0,0 +1,32 @@
+#pragma once
+#include "memory.h"
+
+#define COVERAGE_SIZE       (1 << 16)
+#define COVERAGE_MAX_EDGES  4096
+
+/*
+  COVERAGE TRACE:
+  Taken branches for one run, keyed on (source >> 1) ^ target like AFL so
+  A->B and B->A land in different slots. Touched keeps the slots hit this run
+  so they can be checked and cleared without sweeping the whole map.
+*/
+typedef struct CoverageTrace
+{
+    byte        Hits[COVERAGE_SIZE];
+    word        Touched[COVERAGE_MAX_EDGES];
+    int         Count;
+
+    inline void Edge(word from, word to)
+    {
+        word slot = (from >> 1) ^ to;
+        if (Hits[slot] == 0)
+        {
+            // A slot that can't go in Touched would never be cleared, so it isn't counted at all
+            if (Count == COVERAGE_MAX_EDGES)
+                return;
+            Touched[Count++] = slot;
+        }
+        if (Hits[slot] != 0xFF)
+            Hits[slot]++;
+    }
+} CoverageTrace;
@@ -1,16 +1,47 @@
 #include "cpu.h"
+#include "telemetry.h"
+#include "hash.h"
 
 CPU::CPU()
 {
-    // Initiate memory
-    memset(m_Memory, 0, sizeof(m_Memory));
-    // Reset Registers
-    ResetRegisters();
+    Reset();
+}
+
+/*
+    Run a cartridge that's shared with other CPUs, only pages we write to get copied
+*/
+CPU::CPU(std::shared_ptr<const Cartridge> cartridge)
+{
+    Reset();
+    m_Memory.Attach(cartridge);
 }
 
 CPU::~CPU()
 {
-    exit(1);
+}
+
+void CPU::Reset()
+{
+    memset(m_Screen, 0, sizeof(m_Screen));
+    m_Framebuffer = m_Screen;
+    // Reset Registers
+    ResetRegisters();
+    ResetFlags();
+
+    m_Cycles        = 0;
+    m_FrameEnd      = CYCLES_PER_FRAME;
+    m_Frames        = 0;
+    m_Joypad        = 0x00;
+    m_JoypadSelect  = 0x30;
+    m_Coverage      = NULL;
+    m_Telemetry     = NULL;
+    memset(&m_Counters, 0, sizeof(m_Counters));
+
+    m_IME           = false;
+    m_IE            = 0x00;
+    m_IF            = 0x00;
+    m_EIDelay       = 0;
+    UpdateInterrupts();
 }
 
 /*
@@ -67,21 +98,21 @@ bool CPU::GetCondFlag(Conditions condition)
 */
 bool CPU::LoadInstructions(const std::string fileName)
 {
-    FILE *fp;
-    fp = fopen(fileName.c_str(), "rb");
-    if (fp == NULL)
-    {
-        perror("Instruction File Open Failed:");
+    std::shared_ptr<const Cartridge> cartridge = Cartridge::Load(fileName);
+    if (!cartridge)
         return false;
-    }
-    fread(m_Memory, 1, MEMSIZE, fp);
-    fclose(fp);
+    m_Memory.Attach(cartridge);
     return true;
 }
 
 void CPU::FillMem(byte val)
 {
-    memset(m_Memory, val, sizeof(m_Memory));
+    m_Memory.Attach(Cartridge::Filled(val));
+}
+
+void CPU::WriteMem(word address, byte val)
+{
+    WriteByte(address, val);
 }
 
 void CPU::DumpMem(word start, word end)
@@ -92,14 +123,19 @@ void CPU::DumpMem(word start, word end)
         if ((i%16)==0 && (i != start)){
             printf("\n");
         }
-        printf("%02X ", m_Memory[i]);
+        printf("%02X ", m_Memory.Read(i));
     }
     printf("\n");
 }
 
 void CPU::WriteByte(word address, byte val)
 {
-    m_Memory[address] = val;
+    if (address >= 0xFF00)
+    {
+        WriteIO(address, val);
+        return;
+    }
+    m_Memory.Write(address, val);
 }
 
 void CPU::WriteWord(word address, word val)
@@ -107,18 +143,62 @@ void CPU::WriteWord(word address, word val)
     byte low = val & 0xFF;
     byte high = (val >> 8) & 0xFF;
 
-    m_Memory[address] = low;
-    m_Memory[address+1] = high;
+    WriteByte(address, low);
+    WriteByte(address+1, high);
 }
 
 byte CPU::ReadByte(word address)
 {
-    return m_Memory[address];
+    if (address >= 0xFF00)
+        return ReadIO(address);
+    return m_Memory.Read(address);
+}
+
+/*
+    IO registers live in the top page, anything without special behaviour
+    is just stored in memory
+*/
+byte CPU::ReadIO(word address)
+{
+    if (address >= APU_START && address <= APU_END)
+        return m_APU.Read(address, m_Cycles);
+
+    switch (address)
+    {
+        case REG_JOYP:
+        {
+            // Buttons are active low, bit 4 selects the d-pad and bit 5 the action buttons
+            byte pressed = 0x00;
+            if (!(m_JoypadSelect & 0x10)) pressed |= m_Joypad & 0x0F;
+            if (!(m_JoypadSelect & 0x20)) pressed |= (m_Joypad >> 4) & 0x0F;
+            return 0xC0 | m_JoypadSelect | (~pressed & 0x0F);
+        }
+        case REG_IF: return 0xE0 | m_IF;
+        case REG_IE: return m_IE;
+    }
+    return m_Memory.Read(address);
+}
+
+void CPU::WriteIO(word address, byte val)
+{
+    if (address >= APU_START && address <= APU_END)
+    {
+        m_APU.Write(address, val, m_Cycles);
+        return;
+    }
+
+    switch (address)
+    {
+        case REG_JOYP: m_JoypadSelect = val & 0x30; return;
+        case REG_IF: m_IF = val & INT_ALL; UpdateInterrupts(); return;
+        case REG_IE: m_IE = val; UpdateInterrupts(); return;
+    }
+    m_Memory.Write(address, val);
 }
 
 word CPU::ReadWord(word address)
 {
-    return (m_Memory[address + 1] << 8) | m_Memory[address];
+    return (ReadByte(address + 1) << 8) | ReadByte(address);
 }
 
 /*
@@ -133,7 +213,7 @@ void CPU::StackPush(word val)
 
 word CPU::StackPop()
 {
-    word val = ReadByte(m_Registers.SP.reg);
+    word val = ReadWord(m_Registers.SP.reg);
     m_Registers.SP.reg += 2;
 
     return val;
@@ -144,12 +224,261 @@ word CPU::StackPop()
 */
 void CPU::Cycle()
 {
-    byte curOp = Fetch();
-    while (Execute(curOp))
+    do
     {
+        INFO("Executing {:X}", m_Memory.Read(m_Registers.PC.reg));
+        // Stepping this slowly never reaches a frame end, so publish every step
+        PublishTelemetry();
         sleep(1);
-        curOp = Fetch();
     }
+    while (Step());
+}
+
+/*
+    Step - fetch and execute a single instruction
+*/
+bool CPU::Step()
+{
+    byte curOp = Fetch();
+    m_Cycles += CYCLES_PER_INSTR;
+    m_Counters.Instructions++;
+    m_Counters.Cycles += CYCLES_PER_INSTR;
+    bool running = Execute(curOp);
+
+    if (m_IntCheck)
+        HandleInterrupts();
+
+    return running;
+}
+
+/*
+    Interrupts - the run loop only looks at m_IntCheck, so it has to be
+    recomputed by anything that touches IE, IF, IME or the EI delay
+*/
+void CPU::UpdateInterrupts()
+{
+    m_IntCheck = m_EIDelay;
+    if (m_IME)
+        m_IntCheck |= (m_IE & m_IF & INT_ALL) << 8;
+}
+
+void CPU::RequestInterrupt(Interrupts source)
+{
+    m_IF |= source;
+    UpdateInterrupts();
+}
+
+void CPU::HandleInterrupts()
+{
+    // EI takes effect after the instruction following it
+    if (m_EIDelay && --m_EIDelay == 0)
+        m_IME = true;
+
+    byte pending = m_IME ? (m_IE & m_IF & INT_ALL) : 0;
+    if (pending)
+    {
+        byte bit = __builtin_ctz(pending);
+
+        m_IF &= ~(1 << bit);
+        m_IME = false;
+
+        StackPush(m_Registers.PC.reg);
+        m_Registers.PC.reg = INT_VECTOR_BASE + bit * 8;
+        m_Cycles += INT_DISPATCH_CYCLES;
+        m_Counters.Cycles += INT_DISPATCH_CYCLES;
+        m_Counters.Interrupts++;
+    }
+
+    UpdateInterrupts();
+}
+
+/*
+    Run instructions up to the end of the current frame. Returns false if the
+    CPU stopped on an unimplemented opcode
+*/
+bool CPU::RunFrame(bool render)
+{
+    while (m_Cycles < m_FrameEnd)
+    {
+        if (!Step())
+            return false;
+    }
+    EndFrame(render);
+    return true;
+}
+
+bool CPU::Run(quadword instructions)
+{
+    for (quadword i = 0; i < instructions; i++)
+    {
+        if (!Step())
+            return false;
+        if (m_Cycles >= m_FrameEnd)
+            EndFrame(false);
+    }
+    return true;
+}
+
+bool CPU::RunFrame(bool render, quadword& instructions)
+{
+    while (instructions)
+    {
+        if (!Step())
+            return false;
+        instructions--;
+        if (m_Cycles >= m_FrameEnd)
+        {
+            EndFrame(render);
+            break;
+        }
+    }
+    return true;
+}
+
+void CPU::EndFrame(bool render)
+{
+    m_FrameEnd += CYCLES_PER_FRAME;
+    m_Frames++;
+    m_Counters.Frames++;
+    m_APU.EndFrame(m_Cycles);
+    RequestInterrupt(INT_VBLANK);
+
+    if (m_Telemetry)
+        PublishTelemetry();
+
+    // Hidden frames (run-ahead, headless runs) skip drawing entirely
+    if (render)
+        RenderFrame();
+}
+
+void CPU::PublishTelemetry()
+{
+    if (m_Telemetry)
+        Telemetry::Publish(m_Telemetry, m_Counters, m_Registers.PC.reg);
+}
+
+void CPU::SetJoypad(byte buttons)
+{
+    // Any newly pressed button raises the joypad interrupt
+    if (buttons & ~m_Joypad)
+        RequestInterrupt(INT_JOYPAD);
+    m_Joypad = buttons;
+}
+
+/*
+    Background only for now - 32x32 map of 8x8 tiles, 2 bits per pixel
+*/
+void CPU::RenderFrame()
+{
+    static const byte shades[4] = { 0xFF, 0xAA, 0x55, 0x00 };
+
+    byte lcdc = m_Memory.Read(REG_LCDC);
+    byte scy  = m_Memory.Read(REG_SCY);
+    byte scx  = m_Memory.Read(REG_SCX);
+    byte bgp  = m_Memory.Read(REG_BGP);
+
+    if (!(lcdc & 0x01))
+    {
+        memset(m_Framebuffer, shades[0], SCREEN_SIZE);
+        return;
+    }
+
+    word mapBase  = (lcdc & 0x08) ? 0x9C00 : 0x9800;
+    bool unsignedTiles = lcdc & 0x10;
+
+    for (int y = 0; y < SCREEN_HEIGHT; y++)
+    {
+        byte bgY = y + scy;
+        byte* line = &m_Framebuffer[y * SCREEN_WIDTH];
+        for (int x = 0; x < SCREEN_WIDTH; x++)
+        {
+            byte bgX = x + scx;
+            byte tile = m_Memory.Read(mapBase + (bgY / 8) * 32 + (bgX / 8));
+
+            word tileAddr = unsignedTiles ? 0x8000 + tile * 16
+                                          : 0x9000 + (Sbyte)tile * 16;
+            tileAddr += (bgY % 8) * 2;
+
+            byte bit = 7 - (bgX % 8);
+            byte color = (((m_Memory.Read(tileAddr + 1) >> bit) & 1) << 1)
+                       |  ((m_Memory.Read(tileAddr)     >> bit) & 1);
+
+            line[x] = shades[(bgp >> (color * 2)) & 0x03];
+        }
+    }
+}
+
+/*
+    Snapshots - registers are copied whole, memory only carries the pages we own
+*/
+void CPU::SaveState(CPUState& state) const
+{
+    CopyState(state);
+    m_Memory.Save(state.Memory);
+}
+
+void CPU::LoadState(const CPUState& state)
+{
+    ApplyState(state);
+    m_Memory.Load(state.Memory);
+}
+
+void CPU::MarkState(CPUState& state)
+{
+    SaveState(state);
+    m_Memory.Mark();
+}
+
+void CPU::RewindState(const CPUState& state)
+{
+    ApplyState(state);
+    m_Memory.Rewind(state.Memory);
+}
+
+quadword CPU::HashState(quadword hash)
+{
+    byte flags = m_Flags.Z | (m_Flags.S << 1) | (m_Flags.P << 2) | (m_Flags.C << 3) | (m_Flags.AC << 4);
+
+    hash = HashMix(hash, (quadword)m_Registers.A.reg         | (quadword)m_Registers.BC.reg << 16
+                       | (quadword)m_Registers.DE.reg << 32  | (quadword)m_Registers.HL.reg << 48);
+    hash = HashMix(hash, (quadword)m_Registers.SP.reg        | (quadword)m_Registers.PC.reg << 16
+                       | (quadword)flags << 32               | (quadword)m_IE << 40
+                       | (quadword)m_IF << 48                | (quadword)(m_IME | m_EIDelay << 1) << 56);
+    hash = HashMix(hash, m_Cycles);
+    return m_Memory.HashWritten(hash);
+}
+
+void CPU::CopyState(CPUState& state) const
+{
+    state.Registers     = m_Registers;
+    state.Flags         = m_Flags;
+    state.Cycles        = m_Cycles;
+    state.FrameEnd      = m_FrameEnd;
+    state.Frames        = m_Frames;
+    state.Joypad        = m_Joypad;
+    state.JoypadSelect  = m_JoypadSelect;
+    state.IME           = m_IME;
+    state.IE            = m_IE;
+    state.IF            = m_IF;
+    state.EIDelay       = m_EIDelay;
+    m_APU.Save(state.Audio);
+}
+
+void CPU::ApplyState(const CPUState& state)
+{
+    m_Registers     = state.Registers;
+    m_Flags         = state.Flags;
+    m_Cycles        = state.Cycles;
+    m_FrameEnd      = state.FrameEnd;
+    m_Frames        = state.Frames;
+    m_Joypad        = state.Joypad;
+    m_JoypadSelect  = state.JoypadSelect;
+    m_IME           = state.IME;
+    m_IE            = state.IE;
+    m_IF            = state.IF;
+    m_EIDelay       = state.EIDelay;
+    m_APU.Load(state.Audio);
+    UpdateInterrupts();
 }
 
 /*
@@ -161,7 +490,7 @@ void CPU::Cycle()
 */
 byte CPU::Fetch()
 {
-    byte opCode = m_Memory[m_Registers.PC.reg];
+    byte opCode = m_Memory.Read(m_Registers.PC.reg);
     m_Registers.PC.reg++;
     return opCode;
 }
@@ -169,7 +498,6 @@ byte CPU::Fetch()
 
 bool CPU::Execute(byte opcode)
 {
-    INFO("Executing {:X}", opcode);
     switch (opcode)
     {   
         case 0x00: m_Registers.PC.reg++; break;
@@ -395,9 +723,10 @@ bool CPU::Execute(byte opcode)
         case 0xC8: INSTR_RETURN(Z, true);      break;
         case 0xD0: INSTR_RETURN(C, false);     break;
         case 0xD8: INSTR_RETURN(C, true);      break;
+        case 0xD9: INSTR_RETURN(NONE, false); m_IME = true; UpdateInterrupts(); break; // RETI
 
-        case 0xFB: break; // ENABLES INTERRUPTS
-        case 0xF3: break; // DISABLE INTERRUPTS
+        case 0xFB: m_EIDelay = 2; UpdateInterrupts(); break;                // ENABLES INTERRUPTS
+        case 0xF3: m_IME = false; m_EIDelay = 0; UpdateInterrupts(); break; // DISABLE INTERRUPTS
 
         // UNDEFINED INSTRUCTIONS
         case 0xDD: break;
@@ -1,3 +1,4 @@
+#pragma once
 
 #include <stdio.h>
 #include <string.h>
@@ -12,20 +13,34 @@
 #include <iostream>
 
 #include "log.h"
+#include "memory.h"
+#include "coverage.h"
+#include "apu.h"
 
 // Establish some system macros
-#define MEMSIZE (1<<16)
-// Some memory information like which addresses belong to what here as well, not yet though
+// Timing, one instruction is treated as a single machine cycle until we have per-opcode timings
+#define CYCLES_PER_INSTR    4
+#define CYCLES_PER_FRAME    70224
 
+// LCD
+#define SCREEN_WIDTH        160
+#define SCREEN_HEIGHT       144
+#define SCREEN_SIZE         (SCREEN_WIDTH * SCREEN_HEIGHT)
 
-/*
- * Typedefs for clarity
- */
-typedef uint8_t     byte;
-typedef int8_t      Sbyte;
-typedef uint16_t    word;
-typedef uint32_t    doubleword;
-typedef uint64_t    quadword;
+// IO Registers
+#define REG_JOYP            0xFF00
+#define REG_IF              0xFF0F
+#define REG_LCDC            0xFF40
+#define REG_SCY             0xFF42
+#define REG_SCX             0xFF43
+#define REG_BGP             0xFF47
+#define REG_IE              0xFFFF
+
+// Interrupt vectors are INT_VECTOR_BASE + 8 * bit, handled lowest bit first
+#define INT_VECTOR_BASE     0x40
+#define INT_DISPATCH_CYCLES 20
+// Most a single Step can advance the clock by
+#define MAX_STEP_CYCLES     (CYCLES_PER_INSTR + INT_DISPATCH_CYCLES)
 
 /*
   Size to pass through read and write memory methods
@@ -91,24 +106,172 @@ typedef struct OPflags
 */
 typedef enum Conditions{ Z,S,C,AC, NONE } Conditions;
 
+/*
+  Joypad buttons - one bit each, set when held
+*/
+enum Buttons
+{
+    BUTTON_RIGHT    = 1 << 0,
+    BUTTON_LEFT     = 1 << 1,
+    BUTTON_UP       = 1 << 2,
+    BUTTON_DOWN     = 1 << 3,
+    BUTTON_A        = 1 << 4,
+    BUTTON_B        = 1 << 5,
+    BUTTON_SELECT   = 1 << 6,
+    BUTTON_START    = 1 << 7
+};
+
+/*
+  Interrupt sources - bit positions in IE and IF
+*/
+enum Interrupts
+{
+    INT_VBLANK      = 1 << 0,
+    INT_STAT        = 1 << 1,
+    INT_TIMER       = 1 << 2,
+    INT_SERIAL      = 1 << 3,
+    INT_JOYPAD      = 1 << 4,
+    INT_ALL         = 0x1F
+};
+
+/*
+  CPU STATE:
+  Everything needed to put the machine back exactly where it was, used for
+  snapshots (run-ahead, save states).
+*/
+typedef struct CPUState
+{
+    registers   Registers;
+    OPflags     Flags;
+    quadword    Cycles;
+    quadword    FrameEnd;
+    quadword    Frames;
+    byte        Joypad;
+    byte        JoypadSelect;
+    bool        IME;
+    byte        IE;
+    byte        IF;
+    byte        EIDelay;
+    APUState    Audio;
+    MemoryState Memory;
+} CPUState;
+
+/*
+  CPU COUNTERS:
+  Running totals for telemetry. Not part of CPUState, so they keep counting
+  through rewinds (run-ahead and fuzzing work shows up as real work)
+*/
+typedef struct CPUCounters
+{
+    quadword    Instructions;
+    quadword    Cycles;
+    quadword    Frames;
+    quadword    Interrupts;
+} CPUCounters;
+
+struct TelemetrySlot;
+
 class CPU
 {
     public:
                                     CPU             ();
+                                    CPU             (std::shared_ptr<const Cartridge> cartridge);
                                     ~CPU            ();
         bool                        LoadInstructions  (const std::string fileName);
         void                        FillMem           (byte instr);
         void                        DumpMem           (word start, word end);
         void                        Cycle             ();
 
+        // Run until the end of the current frame, rendering it only if asked to
+        bool                        RunFrame          (bool render);
+        // Run a fixed number of instructions, frames still end on schedule but aren't drawn
+        bool                        Run               (quadword instructions);
+        // Run until the end of the frame or until instructions runs out, whichever comes
+        // first. instructions is counted down by however many ran
+        bool                        RunFrame          (bool render, quadword& instructions);
+        void                        WriteMem          (word address, byte val);
+        void                        SetJoypad         (byte buttons);
+        void                        RequestInterrupt  (Interrupts source);
+        const byte*                 GetFramebuffer    () const { return m_Framebuffer; }
+        // Draw into target instead of our own screen (capture buffers), NULL to go back
+        void                        SetFramebuffer    (byte* target) { m_Framebuffer = target ? target : m_Screen; }
+        quadword                    GetFrames         () const { return m_Frames; }
+        quadword                    GetCycles         () const { return m_Cycles; }
+        const registers&            GetRegisters      () const { return m_Registers; }
+        byte                        ReadMem           (word address) const { return m_Memory.Read(address); }
+
+        // Where finished audio frames go, NULL to skip synthesis
+        void                        SetAudioSink      (AudioSink* sink) { m_APU.SetSink(sink); }
+        AudioSink*                  GetAudioSink      () const { return m_APU.GetSink(); }
+
+        // Snapshots
+        void                        SaveState         (CPUState& state) const;
+        void                        LoadState         (const CPUState& state);
+        // Save and start tracking writes, RewindState then only restores what changed since
+        void                        MarkState         (CPUState& state);
+        void                        RewindState       (const CPUState& state);
+        // Fold registers, flags, timing and every page written since the last call
+        // into hash. Chaining every call covers the whole machine state
+        quadword                    HashState         (quadword hash);
+
+        // Record taken jumps and calls into trace, NULL to stop
+        void                        SetCoverage       (CoverageTrace* trace) { m_Coverage = trace; }
+
+        // Counters are published to slot at the end of every frame, NULL to stop
+        void                        SetTelemetry      (TelemetrySlot* slot) { m_Telemetry = slot; }
+        void                        PublishTelemetry  ();
+        const CPUCounters&          GetCounters       () const { return m_Counters; }
+
     private:
         registers                   m_Registers;
         OPflags                     m_Flags;
-        byte                        m_Memory[MEMSIZE];
+        Memory                      m_Memory;
+
+        // Timing
+        quadword                    m_Cycles;
+        quadword                    m_FrameEnd;
+        quadword                    m_Frames;
+
+        // Interrupts
+        bool                        m_IME;
+        byte                        m_IE;
+        byte                        m_IF;
+        byte                        m_EIDelay;
+        // Non-zero whenever the run loop has interrupt work to do, only
+        // recomputed when IE, IF, IME or the EI delay change
+        word                        m_IntCheck;
+
+        // Peripherals
+        APU                         m_APU;
+        byte                        m_Joypad;
+        byte                        m_JoypadSelect;
+        byte                        m_Screen[SCREEN_SIZE];
+        byte*                       m_Framebuffer;
+
+        CoverageTrace*              m_Coverage;
+        TelemetrySlot*              m_Telemetry;
+        CPUCounters                 m_Counters;
 
         // Execute given opcode
         byte                        Fetch           ();
         bool                        Execute         (byte opcode);
+        bool                        Step            ();
+        void                        EndFrame        (bool render);
+        inline void                 RecordEdge      (word to)
+        {
+            if (m_Coverage)
+                m_Coverage->Edge(m_Registers.PC.reg, to);
+        }
+
+        void                        UpdateInterrupts();
+        void                        HandleInterrupts();
+
+        // Draw the background layer into m_Framebuffer
+        void                        RenderFrame     ();
+
+        // Memory mapped IO
+        byte                        ReadIO          (word address);
+        void                        WriteIO         (word address, byte val);
 
         // Read from
         byte                        ReadByte        (word address);
@@ -121,6 +284,7 @@ class CPU
         void                        StackPush       (word val);
         word                        StackPop        ();
 
+        void                        Reset           ();
         void                        ResetRegisters  ();
         void                        ResetFlags      ();
 
@@ -155,4 +319,7 @@ class CPU
         // Word Instructions
         void                        INSTR_LOAD_WORD  (word& dest, word source);
 
+        void                        CopyState        (CPUState& state) const;
+        void                        ApplyState       (const CPUState& state);
+
 };
\ No newline at end of file
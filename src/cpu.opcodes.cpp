@@ -133,7 +133,7 @@ void CPU::INSTR_LOAD_WORD(word& dest, word source)
 
 void CPU::INSTR_LOAD_MEM(byte& dest, word address)
 {
-    dest = ReadWord(address);
+    dest = ReadByte(address);
 }
 
 void CPU::INSTR_WRITE_MEM(word address, byte source)
@@ -148,10 +148,12 @@ void CPU::INSTR_JUMP(Conditions condition, bool condiStatus)
 
     if (condition == NONE)
     {
+        RecordEdge(jumpPoint);
         m_Registers.PC.reg = jumpPoint;
     }
     else if (GetCondFlag(condition) == condiStatus)
     {
+        RecordEdge(jumpPoint);
         m_Registers.PC.reg = jumpPoint;
     }
 }
@@ -162,10 +164,12 @@ void CPU::INSTR_JUMP_IM(Conditions condition, bool condiStatus)
 
     if (condition == NONE)
     {
+        RecordEdge(m_Registers.PC.reg + jumpVal + 1);
         m_Registers.PC.reg += jumpVal;
     }
     else if (GetCondFlag(condition) == condiStatus)
     {
+        RecordEdge(m_Registers.PC.reg + jumpVal + 1);
         m_Registers.PC.reg += jumpVal;
     }
     
@@ -179,11 +183,13 @@ void CPU::INSTR_CALL(Conditions condition, bool condiStatus)
 
     if (condition == NONE)
     {
+        RecordEdge(jumpPoint);
         StackPush(m_Registers.PC.reg);
         m_Registers.PC.reg = jumpPoint;
     }
     else if (GetCondFlag(condition) == condiStatus)
     {
+        RecordEdge(jumpPoint);
         StackPush(m_Registers.PC.reg);
         m_Registers.PC.reg = jumpPoint;
     }
@@ -0,0 +1,146 @@
+#include "fuzz.h"
+#include <chrono>
+
+Fuzzer::Fuzzer(std::shared_ptr<const Cartridge> cartridge, byte* virgin, int instructionsPerStep, quadword seed)
+    : m_CPU(cartridge)
+{
+    m_Virgin                = virgin;
+    m_InstructionsPerStep   = instructionsPerStep;
+    m_Random                = seed ? seed : 0x9E3779B97F4A7C15ULL;
+    m_Executions            = 0;
+    m_Edges                 = 0;
+    m_Seconds               = 0;
+
+    memset(m_Trace.Hits, 0, sizeof(m_Trace.Hits));
+    m_Trace.Count = 0;
+    m_CPU.SetCoverage(&m_Trace);
+
+    // Everything starts from power on
+    m_CPU.MarkState(m_Base);
+
+    // Seed the corpus with doing nothing
+    FuzzInput empty;
+    empty.Joypad.assign(1, 0x00);
+    m_Corpus.push_back(empty);
+}
+
+/*
+    xorshift64 - cheap and good enough for picking mutations
+*/
+quadword Fuzzer::Random()
+{
+    m_Random ^= m_Random << 13;
+    m_Random ^= m_Random >> 7;
+    m_Random ^= m_Random << 17;
+    return m_Random;
+}
+
+void Fuzzer::Run(quadword executions)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    for (quadword i = 0; i < executions; i++)
+    {
+        // Reuse m_Input's storage so a run doesn't allocate
+        const FuzzInput& parent = m_Corpus[Random() % m_Corpus.size()];
+        m_Input.Joypad.assign(parent.Joypad.begin(), parent.Joypad.end());
+        m_Input.Pokes.assign(parent.Pokes.begin(), parent.Pokes.end());
+
+        Mutate(m_Input);
+
+        if (Execute(m_Input))
+            m_Corpus.push_back(m_Input);
+
+        if (m_Executions % FUZZ_PUBLISH_EVERY == 0)
+            m_CPU.PublishTelemetry();
+    }
+
+    m_Seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/*
+    Run one input from the base snapshot, returns true if it found new edges
+*/
+bool Fuzzer::Execute(const FuzzInput& input)
+{
+    m_CPU.RewindState(m_Base);
+
+    for (size_t i = 0; i < input.Pokes.size(); i++)
+        m_CPU.WriteMem(input.Pokes[i].Address, input.Pokes[i].Value);
+
+    for (size_t i = 0; i < input.Joypad.size(); i++)
+    {
+        m_CPU.SetJoypad(input.Joypad[i]);
+        if (!m_CPU.Run(m_InstructionsPerStep))
+            break;
+    }
+    m_Executions++;
+
+    // Only the slots this run touched need looking at or clearing
+    bool found = false;
+    for (int i = 0; i < m_Trace.Count; i++)
+    {
+        word slot = m_Trace.Touched[i];
+        // Seen edges are read only, so the shared map's lines stay clean across cores
+        if (__atomic_load_n(&m_Virgin[slot], __ATOMIC_RELAXED) == 0 &&
+            __atomic_exchange_n(&m_Virgin[slot], 1, __ATOMIC_RELAXED) == 0)
+        {
+            m_Edges++;
+            found = true;
+        }
+        m_Trace.Hits[slot] = 0;
+    }
+    m_Trace.Count = 0;
+
+    return found;
+}
+
+void Fuzzer::Mutate(FuzzInput& input)
+{
+    int mutations = 1 + Random() % 4;
+    for (int i = 0; i < mutations; i++)
+    {
+        switch (Random() % 5)
+        {
+            // Press or release a button on one step
+            case 0:
+                input.Joypad[Random() % input.Joypad.size()] ^= 1 << (Random() % 8);
+                break;
+
+            // Replace one step's buttons entirely
+            case 1:
+                input.Joypad[Random() % input.Joypad.size()] = Random();
+                break;
+
+            // Make the run longer
+            case 2:
+                if (input.Joypad.size() < FUZZ_MAX_STEPS)
+                    input.Joypad.push_back(Random());
+                break;
+
+            // Write somewhere in RAM before starting
+            case 3:
+                if (input.Pokes.size() < FUZZ_MAX_POKES)
+                {
+                    FuzzPoke poke;
+                    poke.Address = ROM_END + Random() % (MEMSIZE - ROM_END);
+                    poke.Value   = Random();
+                    input.Pokes.push_back(poke);
+                }
+                break;
+
+            // Change an existing write's value
+            case 4:
+                if (!input.Pokes.empty())
+                    input.Pokes[Random() % input.Pokes.size()].Value = Random();
+                break;
+        }
+    }
+}
+
+void Fuzzer::Report() const
+{
+    INFO("Fuzzed {} executions in {:.2f} s ({:.0f} exec/s)", m_Executions, m_Seconds,
+         m_Seconds > 0 ? m_Executions / m_Seconds : 0.0);
+    INFO("  corpus {} inputs, {} new edges", m_Corpus.size(), m_Edges);
+}
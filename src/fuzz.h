@@ -0,0 +1,64 @@
+#pragma once
+#include "cpu.h"
+
+#define FUZZ_MAX_STEPS      64
+#define FUZZ_MAX_POKES      16
+// Runs rarely reach a frame end, so telemetry is published every this many executions
+#define FUZZ_PUBLISH_EVERY  4096
+
+/*
+  FUZZ INPUT:
+  Joypad state for each step of the run, plus memory writes applied before
+  the first instruction
+*/
+typedef struct FuzzPoke
+{
+    word        Address;
+    byte        Value;
+} FuzzPoke;
+
+typedef struct FuzzInput
+{
+    std::vector<byte>       Joypad;
+    std::vector<FuzzPoke>   Pokes;
+} FuzzInput;
+
+/*
+  FUZZER:
+  Coverage guided - every run starts from the same base snapshot, mutates an
+  input from the corpus, and keeps it if it took a jump or call edge nobody
+  has seen before. The virgin map is shared so several fuzzers (one per core)
+  can work on the same cartridge.
+
+  Resetting between runs is a RewindState, which only copies back the pages
+  the last run wrote to.
+*/
+class Fuzzer
+{
+    public:
+                                    Fuzzer          (std::shared_ptr<const Cartridge> cartridge, byte* virgin,
+                                                     int instructionsPerStep, quadword seed);
+        void                        Run             (quadword executions);
+        void                        Report          () const;
+        void                        SetTelemetry    (TelemetrySlot* slot) { m_CPU.SetTelemetry(slot); }
+
+    private:
+        CPU                         m_CPU;
+        CPUState                    m_Base;
+        CoverageTrace               m_Trace;
+        byte*                       m_Virgin;
+        int                         m_InstructionsPerStep;
+
+        std::vector<FuzzInput>      m_Corpus;
+        FuzzInput                   m_Input;
+        quadword                    m_Random;
+
+        // Stats
+        quadword                    m_Executions;
+        quadword                    m_Edges;
+        double                      m_Seconds;
+
+        bool                        Execute         (const FuzzInput& input);
+        void                        Mutate          (FuzzInput& input);
+        quadword                    Random          ();
+};
@@ -0,0 +1,30 @@
+#pragma once
+#include "memory.h"
+
+/*
+  STATE HASH:
+  Multiply/xor mix over eight bytes at a time. Only has to be fast and make
+  a single flipped bit show up, nothing here needs to resist an attacker.
+*/
+#define HASH_SEED           0x9E3779B97F4A7C15ULL
+#define HASH_MULTIPLIER     0xFF51AFD7ED558CCDULL
+
+static inline quadword HashMix(quadword hash, quadword val)
+{
+    hash = (hash ^ val) * HASH_MULTIPLIER;
+    return hash ^ (hash >> 29);
+}
+
+static inline quadword HashBytes(quadword hash, const byte* data, size_t size)
+{
+    for (; size >= 8; data += 8, size -= 8)
+    {
+        quadword val;
+        memcpy(&val, data, 8);
+        hash = HashMix(hash, val);
+    }
+
+    quadword tail = 0;
+    memcpy(&tail, data, size);
+    return HashMix(hash, tail);
+}
@@ -1,17 +1,79 @@
 #include "cpu.h"
+#include "runahead.h"
+#include "fuzz.h"
+#include "telemetry.h"
+#include "capture.h"
+#include "record.h"
+
+#include <unistd.h>
 
 int main(int argc, char **argv)
 {
     Log::Init();
     INFO("CPU INITIALIZED");
     
-    CPU* cpu = new CPU();
     char* instrFile = NULL;
 
-    if (argc==2)
+    // -r <frames> run ahead by that many frames, -n <frames> how many frames to present
+    // -f <executions> fuzz instead, -s <instructions> to run per joypad step while fuzzing
+    // -t publish counters to shared memory for ./monitor
+    // -c <file> record video (.y4m, anything else is raw greyscale), -w <file> record audio as WAV
+    // -a run the APU into a null sink (headless, -w implies audio)
+    // -i <seed> drive the joypad with seeded random presses instead of leaving it released
+    // -R <file> record inputs and state hashes, -H <instructions> per hash, -K <hashes> per keyframe
+    // -P <file> replay a recording and report the first hash mismatch
+    // -b <checkpoint> with -P, trace every instruction up to that checkpoint instead,
+    //    -T <file> to save the trace (reference build), -X <file> to compare against one
+    int runAhead = -1;
+    int frameCount = 600;
+    long fuzzRuns = 0;
+    int fuzzStep = 32;
+    bool telemetry = false;
+    std::string videoFile;
+    std::string audioFile;
+    bool audio = false;
+    std::string recordFile;
+    std::string replayFile;
+    int hashInterval = RECORD_HASH_INTERVAL;
+    int keyframeInterval = RECORD_KEYFRAME_INTERVAL;
+    long bisect = 0;
+    std::string traceOut;
+    std::string traceIn;
+    quadword inputSeed = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "r:n:f:s:tc:w:ai:R:H:K:P:b:T:X:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'r': runAhead = atoi(optarg);   break;
+            case 'n': frameCount = atoi(optarg); break;
+            case 'f': fuzzRuns = atol(optarg);   break;
+            case 's': fuzzStep = atoi(optarg);   break;
+            case 't': telemetry = true;          break;
+            case 'c': videoFile = optarg;        break;
+            case 'w': audioFile = optarg;        break;
+            case 'a': audio = true;              break;
+            case 'i': inputSeed = strtoull(optarg, NULL, 0); break;
+            case 'R': recordFile = optarg;       break;
+            case 'H': hashInterval = atoi(optarg);     break;
+            case 'K': keyframeInterval = atoi(optarg); break;
+            case 'P': replayFile = optarg;       break;
+            case 'b': bisect = atol(optarg);     break;
+            case 'T': traceOut = optarg;         break;
+            case 'X': traceIn = optarg;          break;
+            default:
+                fprintf(stderr, "Usage: %s [-r frames] [-n frames] [-f executions] [-s instructions] [-t] [-c video] [-w audio] [-a] [-i seed]\n"
+                                "       [-R recording [-H instructions] [-K checkpoints]] [-P recording [-b checkpoint -T|-X trace]] [file]\n", argv[0]);
+                exit(-1);
+        }
+    }
+
+    std::shared_ptr<const Cartridge> cartridge;
+    if (optind < argc)
     {
-        instrFile = argv[1];
-        if(!cpu->LoadInstructions(instrFile))
+        instrFile = argv[optind];
+        cartridge = Cartridge::Load(instrFile);
+        if (!cartridge)
         {
             exit(-1);
         }
@@ -19,15 +81,171 @@ int main(int argc, char **argv)
     else
     {
         // Fill memory with NO-OP code
-        cpu->FillMem(0x00);
+        cartridge = Cartridge::Filled(0x00);
+    }
+
+    // Static so every exit() below still runs its destructor and frees the slot
+    static Telemetry counters;
+    TelemetrySlot* slot = NULL;
+    if (telemetry && counters.Create(TELEMETRY_NAME))
+    {
+        slot = counters.Claim();
+        if (!slot)
+            WARN("No free telemetry slots");
+    }
+
+    if (fuzzRuns > 0)
+    {
+        // Unimplemented opcodes are expected here, don't print every one
+        Log::GetLogger()->set_level(spdlog::level::err);
+
+        static byte virgin[COVERAGE_SIZE];
+        Fuzzer* fuzzer = new Fuzzer(cartridge, virgin, fuzzStep, time(NULL));
+        fuzzer->SetTelemetry(slot);
+        fuzzer->Run(fuzzRuns);
+
+        Log::GetLogger()->set_level(spdlog::level::trace);
+        fuzzer->Report();
+        delete fuzzer;
+        exit(1);
     }
 
+    CPU* cpu = new CPU(cartridge);
+    cpu->SetTelemetry(slot);
+
     cpu->DumpMem(0x100, 0x100 + 10);
 
-    cpu->Cycle();
+    if (!recordFile.empty())
+    {
+        if (hashInterval <= 0 || keyframeInterval <= 0)
+        {
+            fprintf(stderr, "Hash and keyframe intervals have to be positive\n");
+            exit(-1);
+        }
+
+        Recorder recorder(cpu);
+        if (!recorder.Open(recordFile, *cartridge, hashInterval, keyframeInterval))
+        {
+            exit(-1);
+        }
+
+        Log::GetLogger()->set_level(spdlog::level::warn);
+        RandomInput input(inputSeed);
+        for (int i = 0; i < frameCount; i++)
+        {
+            if (!recorder.Frame(inputSeed ? input.Next() : 0x00))
+                break;
+        }
+        recorder.Close();
+
+        Log::GetLogger()->set_level(spdlog::level::trace);
+        recorder.Report();
+        delete cpu;
+        exit(1);
+    }
+
+    if (!replayFile.empty())
+    {
+        Replayer replayer(cpu);
+        if (!replayer.Open(replayFile, *cartridge))
+        {
+            exit(-1);
+        }
+
+        Log::GetLogger()->set_level(spdlog::level::warn);
+        if (bisect > 0)
+        {
+            std::vector<TraceEntry> trace;
+            if (!replayer.Trace(bisect, trace))
+            {
+                exit(-1);
+            }
+
+            Log::GetLogger()->set_level(spdlog::level::trace);
+            if (!traceOut.empty())
+                replayer.WriteTrace(traceOut, bisect, trace);
+            if (!traceIn.empty())
+                replayer.Compare(traceIn, bisect, trace);
+        }
+        else
+        {
+            long long mismatch = replayer.Run();
+            if (mismatch == REPLAY_FAILED)
+            {
+                exit(-1);
+            }
+
+            Log::GetLogger()->set_level(spdlog::level::trace);
+            replayer.Report();
+            if (mismatch >= 0)
+                INFO("Narrow it down with -b {} -T <trace> on a build that matches, then -b {} -X <trace> here",
+                     mismatch, mismatch);
+        }
+
+        delete cpu;
+        exit(1);
+    }
+
+    // Recording needs whole frames, so it runs through the frame loop
+    bool capturing = !videoFile.empty() || !audioFile.empty();
+    if ((capturing || audio) && runAhead < 0)
+        runAhead = 0;
+
+    if (runAhead >= 0)
+    {
+        Capture* capture = NULL;
+        if (capturing)
+        {
+            capture = new Capture();
+            if (!capture->Open(videoFile, audioFile))
+            {
+                exit(-1);
+            }
+        }
+
+        NullAudioSink nullSink;
+        if (!audioFile.empty())
+            cpu->SetAudioSink(capture);
+        else if (audio)
+            cpu->SetAudioSink(&nullSink);
+
+        // Per-opcode logging would drown out the frame timings
+        Log::GetLogger()->set_level(spdlog::level::warn);
+
+        RunAhead frontend(cpu, runAhead);
+        RandomInput input(inputSeed);
+        for (int i = 0; i < frameCount; i++)
+        {
+            // The presented frame is drawn straight into a capture buffer
+            byte* frame = capture ? capture->AcquireFrame() : NULL;
+            cpu->SetFramebuffer(frame);
+
+            if (!frontend.Frame(inputSeed ? input.Next() : 0x00))
+                break;
+
+            if (capture)
+                capture->SubmitFrame(frame);
+        }
+        cpu->SetFramebuffer(NULL);
+        cpu->SetAudioSink(NULL);
+
+        Log::GetLogger()->set_level(spdlog::level::trace);
+        frontend.Report();
+
+        if (capture)
+        {
+            capture->Close();
+            INFO("Capture waited on the writer {} times", capture->GetStalls());
+            delete capture;
+        }
+    }
+    else
+    {
+        cpu->Cycle();
+    }
 
     //cpu->~I8080();
     delete cpu;
 
     exit(1);
-}
\ No newline at end of file
+}
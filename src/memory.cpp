@@ -0,0 +1,283 @@
+#include "memory.h"
+#include "hash.h"
+#include "log.h"
+
+/*
+    Cartridge loading - the file is laid out as the full address space, so
+    the first 32K are ROM banks 0 and 1 and the rest of the first 64K is the
+    initial RAM. Anything past 64K is extra ROM banks, 2 onwards.
+*/
+std::shared_ptr<const Cartridge> Cartridge::Load(const std::string fileName)
+{
+    FILE *fp;
+    fp = fopen(fileName.c_str(), "rb");
+    if (fp == NULL)
+    {
+        perror("Instruction File Open Failed:");
+        return NULL;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    std::vector<byte> image(size);
+    size_t read = fread(image.data(), 1, size, fp);
+    fclose(fp);
+    image.resize(read);
+
+    std::shared_ptr<Cartridge> cartridge(new Cartridge());
+
+    // Always at least two banks so both ROM windows have something behind them
+    size_t extra = read > MEMSIZE ? read - MEMSIZE : 0;
+    size_t romSize = ROM_END + (extra + ROM_BANK_SIZE - 1) / ROM_BANK_SIZE * ROM_BANK_SIZE;
+    cartridge->m_ROM.assign(romSize, 0x00);
+    memcpy(cartridge->m_ROM.data(), image.data(), read < ROM_END ? read : ROM_END);
+    if (extra)
+        memcpy(&cartridge->m_ROM[ROM_END], &image[MEMSIZE], extra);
+
+    memset(cartridge->m_RAM, 0x00, sizeof(cartridge->m_RAM));
+    if (read > ROM_END)
+    {
+        size_t ramSize = read - ROM_END;
+        if (ramSize > sizeof(cartridge->m_RAM))
+            ramSize = sizeof(cartridge->m_RAM);
+        memcpy(cartridge->m_RAM, &image[ROM_END], ramSize);
+    }
+
+    return cartridge;
+}
+
+std::shared_ptr<const Cartridge> Cartridge::Filled(byte val)
+{
+    std::shared_ptr<Cartridge> cartridge(new Cartridge());
+    cartridge->m_ROM.assign(ROM_END, val);
+    memset(cartridge->m_RAM, val, sizeof(cartridge->m_RAM));
+    return cartridge;
+}
+
+Memory::Memory()
+{
+    memset(m_Pages, 0, sizeof(m_Pages));
+    memset(m_Private, 0, sizeof(m_Private));
+    memset(m_Dirty, 0, sizeof(m_Dirty));
+    memset(m_Written, 0, sizeof(m_Written));
+
+    // Blank instances all share the same zeroed cartridge
+    static std::shared_ptr<const Cartridge> blank = Cartridge::Filled(0x00);
+    Attach(blank);
+}
+
+Memory::~Memory()
+{
+    for (int page = 0; page < PAGE_COUNT; page++)
+        delete[] m_Pages[page];
+}
+
+/*
+    Point every page back at the cartridge, dropping anything written so far
+*/
+void Memory::Attach(std::shared_ptr<const Cartridge> cartridge)
+{
+    m_Cartridge = cartridge;
+    m_ROMBank = 1;
+    memset(m_Private, 0, sizeof(m_Private));
+    memset(m_Dirty, 0, sizeof(m_Dirty));
+    memset(m_Written, 0, sizeof(m_Written));
+
+    for (int page = 0; page < PAGE_COUNT; page++)
+    {
+        m_Read[page]  = SharedPage(page);
+        m_Write[page] = NULL;
+    }
+}
+
+void Memory::MapROMBank(int bank)
+{
+    int count = m_Cartridge->GetROMBankCount();
+    if (bank >= count)
+        bank %= count;
+
+    m_ROMBank = bank;
+    for (int page = ROM_BANK_SIZE >> PAGE_BITS; page < ROM_END >> PAGE_BITS; page++)
+        m_Read[page] = SharedPage(page);
+}
+
+const byte* Memory::SharedPage(int page) const
+{
+    word address = page << PAGE_BITS;
+    if (address < ROM_BANK_SIZE)
+        return m_Cartridge->GetROMBank(0) + address;
+    if (address < ROM_END)
+        return m_Cartridge->GetROMBank(m_ROMBank) + (address - ROM_BANK_SIZE);
+    return m_Cartridge->GetRAM() + (address - ROM_END);
+}
+
+/*
+    First write to a RAM page copies it out of the cartridge, first write since
+    Mark() marks it dirty. ROM pages never get a write pointer so writes to them
+    are dropped here (bank controllers would hook in at this point).
+*/
+void Memory::WriteSlow(word address, byte val)
+{
+    if (address < ROM_END)
+        return;
+
+    int page = address >> PAGE_BITS;
+    MakePrivate(page);
+
+    m_Write[page] = m_Pages[page];
+    m_Dirty[page / 64]   |= 1ULL << (page % 64);
+    m_Written[page / 64] |= 1ULL << (page % 64);
+    m_Write[page][address & PAGE_MASK] = val;
+}
+
+void Memory::MakePrivate(int page)
+{
+    if (m_Private[page / 64] & (1ULL << (page % 64)))
+        return;
+
+    if (!m_Pages[page])
+        m_Pages[page] = new byte[PAGE_SIZE];
+    memcpy(m_Pages[page], SharedPage(page), PAGE_SIZE);
+
+    m_Read[page] = m_Pages[page];
+    m_Private[page / 64] |= 1ULL << (page % 64);
+}
+
+/*
+    Go back to reading the cartridge, the buffer is kept for the next write
+*/
+void Memory::Release(int page)
+{
+    m_Read[page]  = SharedPage(page);
+    m_Write[page] = NULL;
+    m_Private[page / 64] &= ~(1ULL << (page % 64));
+}
+
+size_t Memory::GetPrivateBytes() const
+{
+    size_t pages = 0;
+    for (int i = 0; i < PAGE_WORDS; i++)
+        pages += __builtin_popcountll(m_Private[i]);
+    return pages * PAGE_SIZE;
+}
+
+/*
+    Snapshots only carry the private pages
+*/
+void Memory::Save(MemoryState& state) const
+{
+    state.ROMBank = m_ROMBank;
+    memcpy(state.Private, m_Private, sizeof(m_Private));
+
+    for (int i = 0; i < PAGE_WORDS; i++)
+    {
+        quadword bits = m_Private[i];
+        while (bits)
+        {
+            int page = i * 64 + __builtin_ctzll(bits);
+            memcpy(state.Pages[page], m_Pages[page], PAGE_SIZE);
+            bits &= bits - 1;
+        }
+    }
+}
+
+void Memory::Load(const MemoryState& state)
+{
+    if (state.ROMBank != m_ROMBank)
+        MapROMBank(state.ROMBank);
+
+    for (int i = 0; i < PAGE_WORDS; i++)
+    {
+        // Everything we touch here may differ from the last Mark()
+        m_Dirty[i] |= m_Private[i] | state.Private[i];
+
+        // Pages we own now but the snapshot didn't go back to the cartridge
+        quadword drop = m_Private[i] & ~state.Private[i];
+        while (drop)
+        {
+            Release(i * 64 + __builtin_ctzll(drop));
+            drop &= drop - 1;
+        }
+
+        quadword bits = state.Private[i];
+        while (bits)
+        {
+            int page = i * 64 + __builtin_ctzll(bits);
+            MakePrivate(page);
+            memcpy(m_Pages[page], state.Pages[page], PAGE_SIZE);
+            // First write after a load still goes through WriteSlow to be tracked
+            m_Write[page] = NULL;
+            bits &= bits - 1;
+        }
+
+        // A loaded state starts out with nothing written
+        m_Written[i] = 0;
+    }
+}
+
+void Memory::Mark()
+{
+    for (int i = 0; i < PAGE_WORDS; i++)
+    {
+        quadword bits = m_Dirty[i];
+        while (bits)
+        {
+            m_Write[i * 64 + __builtin_ctzll(bits)] = NULL;
+            bits &= bits - 1;
+        }
+        m_Dirty[i] = 0;
+    }
+}
+
+void Memory::Rewind(const MemoryState& state)
+{
+    if (state.ROMBank != m_ROMBank)
+        MapROMBank(state.ROMBank);
+
+    for (int i = 0; i < PAGE_WORDS; i++)
+    {
+        quadword bits = m_Dirty[i];
+        while (bits)
+        {
+            int page = i * 64 + __builtin_ctzll(bits);
+            if (state.Private[i] & (1ULL << (page % 64)))
+            {
+                MakePrivate(page);
+                memcpy(m_Pages[page], state.Pages[page], PAGE_SIZE);
+                m_Write[page] = NULL;
+            }
+            else
+            {
+                Release(page);
+            }
+            bits &= bits - 1;
+        }
+        m_Dirty[i] = 0;
+    }
+}
+
+/*
+    Pages that weren't written since the last call can't have changed, so
+    hashing just the written ones keeps a running hash of the whole address
+    space. The page number goes in too, so writing a different page with
+    the same contents still changes the hash.
+*/
+quadword Memory::HashWritten(quadword hash)
+{
+    for (int i = 0; i < PAGE_WORDS; i++)
+    {
+        quadword bits = m_Written[i];
+        while (bits)
+        {
+            int page = i * 64 + __builtin_ctzll(bits);
+            hash = HashMix(hash, page);
+            hash = HashBytes(hash, m_Read[page], PAGE_SIZE);
+            m_Write[page] = NULL;
+            bits &= bits - 1;
+        }
+        m_Written[i] = 0;
+    }
+    return hash;
+}
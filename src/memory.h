@@ -0,0 +1,142 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include <vector>
+#include <string>
+#include <memory>
+
+/*
+ * Typedefs for clarity
+ */
+typedef uint8_t     byte;
+typedef int8_t      Sbyte;
+typedef uint16_t    word;
+typedef uint32_t    doubleword;
+typedef uint64_t    quadword;
+
+#define MEMSIZE (1<<16)
+
+/*
+  MEMORY MAP:
+   - 0x0000-0x3FFF: ROM bank 0
+   - 0x4000-0x7FFF: Switchable ROM bank
+   - 0x8000-0xFFFF: VRAM, cartridge RAM, WRAM, OAM, IO and HRAM
+  The address space is split into pages, ROM pages are read-only views into
+  the cartridge and RAM pages start out as views into the cartridge's initial
+  image until something writes to them
+*/
+#define ROM_END             0x8000
+#define ROM_BANK_SIZE       0x4000
+
+#define PAGE_BITS           8
+#define PAGE_SIZE           (1 << PAGE_BITS)
+#define PAGE_MASK           (PAGE_SIZE - 1)
+#define PAGE_COUNT          (MEMSIZE >> PAGE_BITS)
+#define PAGE_WORDS          (PAGE_COUNT / 64)
+
+/*
+  CARTRIDGE:
+  Immutable once loaded, so any number of CPUs running the same game can share
+  one copy of the ROM banks and of the initial RAM image
+*/
+class Cartridge
+{
+    public:
+        static std::shared_ptr<const Cartridge> Load    (const std::string fileName);
+        static std::shared_ptr<const Cartridge> Filled  (byte val);
+
+        const byte*                 GetROMBank      (int bank) const { return &m_ROM[bank * ROM_BANK_SIZE]; }
+        int                         GetROMBankCount () const { return m_ROM.size() / ROM_BANK_SIZE; }
+        // Initial contents of everything above ROM_END
+        const byte*                 GetRAM          () const { return m_RAM; }
+
+    private:
+        std::vector<byte>           m_ROM;
+        byte                        m_RAM[MEMSIZE - ROM_END];
+};
+
+/*
+  MEMORY STATE:
+  Contents of the pages an instance has written to, everything else is still
+  whatever the cartridge says
+*/
+typedef struct MemoryState
+{
+    int         ROMBank;
+    quadword    Private[PAGE_WORDS];
+    byte        Pages[PAGE_COUNT][PAGE_SIZE];
+} MemoryState;
+
+/*
+  MEMORY:
+  Per-instance view of the address space through a page table. Reads always go
+  straight through m_Read. Writes go through m_Write, which stays NULL until a
+  page has been copied out of the cartridge (copy on write) or forever for ROM.
+
+  m_Write is also how dirty pages are tracked - Mark() drops every write
+  pointer, so the first write to each page after it lands in WriteSlow and
+  gets recorded. Rewind() then only has to put those pages back.
+  HashWritten() drops write pointers the same way, so both can run at once.
+*/
+class Memory
+{
+    public:
+                                    Memory          ();
+                                    ~Memory         ();
+        // Owns its page buffers, copy through Save/Load instead
+                                    Memory          (const Memory&) = delete;
+        Memory&                     operator=       (const Memory&) = delete;
+
+        void                        Attach          (std::shared_ptr<const Cartridge> cartridge);
+        void                        MapROMBank      (int bank);
+
+        inline byte                 Read            (word address) const
+        {
+            return m_Read[address >> PAGE_BITS][address & PAGE_MASK];
+        }
+
+        inline void                 Write           (word address, byte val)
+        {
+            byte* page = m_Write[address >> PAGE_BITS];
+            if (page)
+                page[address & PAGE_MASK] = val;
+            else
+                WriteSlow(address, val);
+        }
+
+        // Bytes this instance owns on top of the shared cartridge
+        size_t                      GetPrivateBytes () const;
+
+        void                        Save            (MemoryState& state) const;
+        void                        Load            (const MemoryState& state);
+
+        // Start tracking writes from here, state must hold what Save gave at this point
+        void                        Mark            ();
+        // Undo everything written since the last Mark()
+        void                        Rewind          (const MemoryState& state);
+
+        // Fold every page written since the last call into hash and start over
+        quadword                    HashWritten     (quadword hash);
+
+    private:
+        std::shared_ptr<const Cartridge> m_Cartridge;
+        int                         m_ROMBank;
+
+        const byte*                 m_Read[PAGE_COUNT];
+        byte*                       m_Write[PAGE_COUNT];
+
+        // Private copies, allocated on first write and kept around for reuse
+        byte*                       m_Pages[PAGE_COUNT];
+        quadword                    m_Private[PAGE_WORDS];
+        // Pages written since the last Mark()
+        quadword                    m_Dirty[PAGE_WORDS];
+        // Pages written since the last HashWritten(), tracked the same way
+        quadword                    m_Written[PAGE_WORDS];
+
+        void                        WriteSlow       (word address, byte val);
+        void                        MakePrivate     (int page);
+        void                        Release         (int page);
+        const byte*                 SharedPage      (int page) const;
+};
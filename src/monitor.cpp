@@ -0,0 +1,66 @@
+#include "telemetry.h"
+
+#include <unistd.h>
+
+/*
+    Reads the telemetry region of running emulators, never blocks them
+*/
+int main(int argc, char **argv)
+{
+    Log::Init();
+
+    std::string name = argc > 1 ? argv[1] : TELEMETRY_NAME;
+    Telemetry telemetry;
+    if (!telemetry.Attach(name))
+    {
+        exit(-1);
+    }
+
+    const TelemetryRegion* region = telemetry.GetRegion();
+    quadword lastInstructions[TELEMETRY_SLOTS] = { 0 };
+    quadword lastPid[TELEMETRY_SLOTS]          = { 0 };
+
+    while (true)
+    {
+        printf("%4s %8s %10s %10s %8s %10s %6s %10s %8s\n",
+               "SLOT", "PID", "INSTR", "MIPS", "MHZ", "FRAMES", "PC", "INTERRUPTS", "BLOCK%");
+        for (doubleword i = 0; i < TELEMETRY_SLOTS; i++)
+        {
+            // Free slots and ones left behind by a crashed emulator
+            const TelemetrySlot& slot = region->Slots[i];
+            if (!Telemetry::InUse(slot))
+            {
+                lastPid[i] = 0;
+                continue;
+            }
+            quadword pid          = slot.Pid.load(std::memory_order_relaxed);
+            quadword instructions = slot.Instructions.load(std::memory_order_relaxed);
+            quadword lookups      = slot.BlockLookups.load(std::memory_order_relaxed);
+            quadword hits         = slot.BlockHits.load(std::memory_order_relaxed);
+
+            char hitRate[16] = "-";
+            if (lookups)
+                snprintf(hitRate, sizeof(hitRate), "%.1f", 100.0 * hits / lookups);
+
+            // A rate needs a previous sample from the same emulator
+            char mips[16] = "-";
+            if (lastPid[i] == pid)
+                snprintf(mips, sizeof(mips), "%.2f", (instructions - lastInstructions[i]) / 1e6);
+
+            printf("%4u %8llu %10llu %10s %8.2f %10llu %6llX %10llu %8s\n", i,
+                   (unsigned long long)pid,
+                   (unsigned long long)instructions,
+                   mips,
+                   slot.KHz.load(std::memory_order_relaxed) / 1000.0,
+                   (unsigned long long)slot.Frames.load(std::memory_order_relaxed),
+                   (unsigned long long)slot.PC.load(std::memory_order_relaxed),
+                   (unsigned long long)slot.Interrupts.load(std::memory_order_relaxed),
+                   hitRate);
+            lastInstructions[i] = instructions;
+            lastPid[i]          = pid;
+        }
+        printf("\n");
+        fflush(stdout);
+        sleep(1);
+    }
+}
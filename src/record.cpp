@@ -0,0 +1,521 @@
+#include "record.h"
+#include "hash.h"
+
+#include <stddef.h>
+#include <algorithm>
+#include <chrono>
+
+typedef std::chrono::steady_clock Clock;
+
+// Checkpoints are small and frequent, keep them from turning into tiny writes
+#define RECORD_FILE_BUFFER      (1 << 20)
+// A keyframe is the CPUState up to here, followed by its private pages
+#define KEYFRAME_FIXED_SIZE     offsetof(CPUState, Memory.Pages)
+
+static double Elapsed(Clock::time_point start, Clock::time_point end)
+{
+    return std::chrono::duration<double>(end - start).count();
+}
+
+quadword HashCartridge(const Cartridge& cartridge)
+{
+    quadword hash = HASH_SEED;
+    for (int bank = 0; bank < cartridge.GetROMBankCount(); bank++)
+        hash = HashBytes(hash, cartridge.GetROMBank(bank), ROM_BANK_SIZE);
+    return HashBytes(hash, cartridge.GetRAM(), MEMSIZE - ROM_END);
+}
+
+Recorder::Recorder(CPU* cpu)
+{
+    m_CPU           = cpu;
+    m_File          = NULL;
+    m_Buttons       = 0;
+    m_Instructions  = 0;
+    m_Checkpoints   = 0;
+    m_Keyframes     = 0;
+    m_Hash          = HASH_SEED;
+    m_Seconds       = 0;
+}
+
+Recorder::~Recorder()
+{
+    Close();
+}
+
+/*
+    The recording starts from wherever the CPU is now, so the first thing in
+    it is a keyframe of the current state
+*/
+bool Recorder::Open(const std::string fileName, const Cartridge& cartridge, int hashInterval, int keyframeInterval)
+{
+    m_File = fopen(fileName.c_str(), "wb");
+    if (m_File == NULL)
+    {
+        perror("Recording Open Failed:");
+        return false;
+    }
+    setvbuf(m_File, NULL, _IOFBF, RECORD_FILE_BUFFER);
+
+    m_Header.Magic              = RECORD_MAGIC;
+    m_Header.Version            = RECORD_VERSION;
+    m_Header.HashInterval       = hashInterval;
+    m_Header.KeyframeInterval   = keyframeInterval;
+    m_Header.Cartridge          = HashCartridge(cartridge);
+    fwrite(&m_Header, sizeof(m_Header), 1, m_File);
+
+    // Pages written before now are covered by the keyframe, start the hash from there
+    m_Hash = m_CPU->HashState(HASH_SEED);
+    WriteKeyframe();
+    m_Buttons = m_State.Joypad;
+    return true;
+}
+
+void Recorder::Close()
+{
+    if (m_File)
+    {
+        fclose(m_File);
+        m_File = NULL;
+    }
+}
+
+/*
+    Run one frame, returns false once the CPU stops
+*/
+bool Recorder::Frame(byte buttons)
+{
+    Clock::time_point start = Clock::now();
+
+    if (buttons != m_Buttons)
+    {
+        m_CPU->SetJoypad(buttons);
+        m_Buttons = buttons;
+
+        RecordInput input = {};
+        input.Cycles  = m_CPU->GetCycles();
+        input.Buttons = buttons;
+        fputc(RECORD_INPUT, m_File);
+        fwrite(&input, sizeof(input), 1, m_File);
+    }
+
+    // Run in slices that stop at the frame end or the next checkpoint
+    quadword frame = m_CPU->GetFrames();
+    bool running = true;
+    while (running && m_CPU->GetFrames() == frame)
+    {
+        quadword slice = (m_Checkpoints + 1) * m_Header.HashInterval - m_Instructions;
+        quadword left = slice;
+        running = m_CPU->RunFrame(false, left);
+        m_Instructions += slice - left;
+
+        if (left == 0)
+            Checkpoint();
+    }
+
+    m_Seconds += Elapsed(start, Clock::now());
+    return running;
+}
+
+void Recorder::Checkpoint()
+{
+    m_Hash = m_CPU->HashState(m_Hash);
+    m_Checkpoints++;
+
+    fputc(RECORD_HASH, m_File);
+    fwrite(&m_Hash, sizeof(m_Hash), 1, m_File);
+
+    if (m_Checkpoints % m_Header.KeyframeInterval == 0)
+        WriteKeyframe();
+}
+
+void Recorder::WriteKeyframe()
+{
+    m_CPU->SaveState(m_State);
+
+    RecordKeyframe keyframe;
+    keyframe.Checkpoint = m_Checkpoints;
+    keyframe.Hash       = m_Hash;
+    fputc(RECORD_KEYFRAME, m_File);
+    fwrite(&keyframe, sizeof(keyframe), 1, m_File);
+    fwrite(&m_State, KEYFRAME_FIXED_SIZE, 1, m_File);
+
+    for (int i = 0; i < PAGE_WORDS; i++)
+    {
+        quadword bits = m_State.Memory.Private[i];
+        while (bits)
+        {
+            fwrite(m_State.Memory.Pages[i * 64 + __builtin_ctzll(bits)], PAGE_SIZE, 1, m_File);
+            bits &= bits - 1;
+        }
+    }
+    m_Keyframes++;
+}
+
+void Recorder::Report() const
+{
+    INFO("Recorded {} instructions in {:.2f} s ({:.1f} MIPS)", m_Instructions, m_Seconds,
+         m_Seconds > 0 ? m_Instructions / m_Seconds / 1e6 : 0.0);
+    INFO("  {} checkpoints every {} instructions, {} keyframes", m_Checkpoints,
+         m_Header.HashInterval, m_Keyframes);
+}
+
+RandomInput::RandomInput(quadword seed)
+{
+    m_Random    = seed ? seed : HASH_SEED;
+    m_Buttons   = 0;
+    m_Hold      = 0;
+}
+
+/*
+    Buttons for the next frame
+*/
+byte RandomInput::Next()
+{
+    if (m_Hold-- > 0)
+        return m_Buttons;
+
+    m_Random ^= m_Random << 13;
+    m_Random ^= m_Random >> 7;
+    m_Random ^= m_Random << 17;
+
+    // Half the time let go of everything, otherwise press up to a couple of buttons
+    m_Buttons = (m_Random & 1) ? 0 : (1 << ((m_Random >> 8) % 8)) | (1 << ((m_Random >> 16) % 8));
+    m_Hold    = 1 + (m_Random >> 24) % RANDOM_INPUT_MAX_HOLD;
+    return m_Buttons;
+}
+
+Replayer::Replayer(CPU* cpu)
+{
+    m_CPU           = cpu;
+    m_File          = NULL;
+    m_Checkpoint    = 0;
+    m_Instructions  = 0;
+    m_Hash          = HASH_SEED;
+    m_NextInput     = 0;
+    m_Mismatch      = REPLAY_MATCHED;
+    m_Seconds       = 0;
+}
+
+Replayer::~Replayer()
+{
+    if (m_File)
+        fclose(m_File);
+}
+
+static int PrivatePages(const CPUState& state)
+{
+    int pages = 0;
+    for (int i = 0; i < PAGE_WORDS; i++)
+        pages += __builtin_popcountll(state.Memory.Private[i]);
+    return pages;
+}
+
+/*
+    Inputs and hashes are small enough to keep in memory, keyframes are only
+    indexed and read back when something seeks to them. A recording cut off
+    part way (the recorder was killed) still plays up to where it stops.
+*/
+bool Replayer::Open(const std::string fileName, const Cartridge& cartridge)
+{
+    m_File = fopen(fileName.c_str(), "rb");
+    if (m_File == NULL)
+    {
+        perror("Recording Open Failed:");
+        return false;
+    }
+
+    if (fread(&m_Header, sizeof(m_Header), 1, m_File) != 1 ||
+        m_Header.Magic != RECORD_MAGIC || m_Header.Version != RECORD_VERSION)
+    {
+        ERROR("{} is not a recording", fileName);
+        return false;
+    }
+    if (m_Header.Cartridge != HashCartridge(cartridge))
+    {
+        ERROR("{} was recorded with a different cartridge", fileName);
+        return false;
+    }
+
+    bool complete = true;
+    int tag;
+    while (complete && (tag = fgetc(m_File)) != EOF)
+    {
+        switch (tag)
+        {
+            case RECORD_INPUT:
+            {
+                RecordInput input;
+                complete = fread(&input, sizeof(input), 1, m_File) == 1;
+                if (complete)
+                    m_Inputs.push_back(input);
+                break;
+            }
+            case RECORD_HASH:
+            {
+                quadword hash;
+                complete = fread(&hash, sizeof(hash), 1, m_File) == 1;
+                if (complete)
+                    m_Hashes.push_back(hash);
+                break;
+            }
+            case RECORD_KEYFRAME:
+            {
+                RecordKeyframe keyframe;
+                long offset = ftell(m_File) + sizeof(keyframe);
+                complete = fread(&keyframe, sizeof(keyframe), 1, m_File) == 1 &&
+                           fread(&m_State, KEYFRAME_FIXED_SIZE, 1, m_File) == 1 &&
+                           fseek(m_File, (long)PrivatePages(m_State) * PAGE_SIZE, SEEK_CUR) == 0;
+                if (complete)
+                {
+                    m_Keyframes.push_back(keyframe);
+                    m_KeyframeOffsets.push_back(offset);
+                }
+                break;
+            }
+            default:
+                ERROR("{} is corrupt at offset {}", fileName, ftell(m_File) - 1);
+                return false;
+        }
+    }
+
+    if (!complete)
+        WARN("{} is truncated, playing what's there", fileName);
+    if (m_Keyframes.empty())
+    {
+        ERROR("{} has no keyframes", fileName);
+        return false;
+    }
+
+    INFO("Recording has {} checkpoints, {} keyframes and {} inputs", m_Hashes.size(),
+         m_Keyframes.size(), m_Inputs.size());
+    return true;
+}
+
+/*
+    Load the last keyframe at or before checkpoint
+*/
+bool Replayer::Restore(quadword checkpoint)
+{
+    size_t index = 0;
+    while (index + 1 < m_Keyframes.size() && m_Keyframes[index + 1].Checkpoint <= checkpoint)
+        index++;
+
+    fseek(m_File, m_KeyframeOffsets[index], SEEK_SET);
+    if (fread(&m_State, KEYFRAME_FIXED_SIZE, 1, m_File) != 1)
+        return false;
+    for (int i = 0; i < PAGE_WORDS; i++)
+    {
+        quadword bits = m_State.Memory.Private[i];
+        while (bits)
+        {
+            if (fread(m_State.Memory.Pages[i * 64 + __builtin_ctzll(bits)], PAGE_SIZE, 1, m_File) != 1)
+                return false;
+            bits &= bits - 1;
+        }
+    }
+    m_CPU->LoadState(m_State);
+
+    m_Checkpoint    = m_Keyframes[index].Checkpoint;
+    m_Instructions  = m_Checkpoint * m_Header.HashInterval;
+    m_Hash          = m_Keyframes[index].Hash;
+
+    // An input on the keyframe's own cycle came after it, the recorder hashes first
+    quadword cycles = m_CPU->GetCycles();
+    m_NextInput = std::lower_bound(m_Inputs.begin(), m_Inputs.end(), cycles,
+                                   [](const RecordInput& input, quadword at) { return input.Cycles < at; })
+                - m_Inputs.begin();
+    return true;
+}
+
+void Replayer::ApplyInputs()
+{
+    while (m_NextInput < m_Inputs.size() && m_Inputs[m_NextInput].Cycles <= m_CPU->GetCycles())
+    {
+        m_CPU->SetJoypad(m_Inputs[m_NextInput].Buttons);
+        m_NextInput++;
+    }
+}
+
+/*
+    Run up to an instruction count, stopping along the way to hand over any
+    input that was recorded in between. Returns false if the CPU stops.
+*/
+bool Replayer::RunTo(quadword instructions)
+{
+    while (m_Instructions < instructions)
+    {
+        ApplyInputs();
+
+        quadword slice = instructions - m_Instructions;
+        if (m_NextInput < m_Inputs.size())
+        {
+            quadword until = (m_Inputs[m_NextInput].Cycles - m_CPU->GetCycles()) / MAX_STEP_CYCLES;
+            slice = std::min(slice, std::max(until, (quadword)1));
+        }
+
+        if (!m_CPU->Run(slice))
+            return false;
+        m_Instructions += slice;
+    }
+    return true;
+}
+
+/*
+    Play from the current position up to checkpoint, returns the first one
+    that didn't match or -1
+*/
+long long Replayer::PlayTo(quadword checkpoint)
+{
+    while (m_Checkpoint < checkpoint)
+    {
+        // The recording got past this checkpoint, so stopping short of it is a mismatch too
+        if (!RunTo((m_Checkpoint + 1) * m_Header.HashInterval))
+            return m_Checkpoint + 1;
+
+        m_Hash = m_CPU->HashState(m_Hash);
+        m_Checkpoint++;
+        if (m_Hash != m_Hashes[m_Checkpoint - 1])
+            return m_Checkpoint;
+    }
+    return REPLAY_MATCHED;
+}
+
+long long Replayer::Run()
+{
+    Clock::time_point start = Clock::now();
+    if (!Restore(0))
+    {
+        ERROR("Couldn't read the first keyframe");
+        return REPLAY_FAILED;
+    }
+    m_Mismatch = PlayTo(m_Hashes.size());
+    m_Seconds = Elapsed(start, Clock::now());
+    return m_Mismatch;
+}
+
+void Replayer::Report() const
+{
+    INFO("Replayed {} instructions in {:.2f} s ({:.1f} MIPS)", m_Instructions, m_Seconds,
+         m_Seconds > 0 ? m_Instructions / m_Seconds / 1e6 : 0.0);
+    if (m_Mismatch < 0)
+    {
+        INFO("  all {} checkpoints match", m_Hashes.size());
+        return;
+    }
+
+    quadword keyframe = 0;
+    for (size_t i = 0; i < m_Keyframes.size() && m_Keyframes[i].Checkpoint < (quadword)m_Mismatch; i++)
+        keyframe = m_Keyframes[i].Checkpoint;
+    WARN("  first mismatch at checkpoint {} (instructions {} to {}), nearest keyframe is checkpoint {}",
+         m_Mismatch, (m_Mismatch - 1) * m_Header.HashInterval, m_Mismatch * m_Header.HashInterval, keyframe);
+}
+
+/*
+    Hash after every instruction between checkpoint-1 and checkpoint
+*/
+bool Replayer::Trace(quadword checkpoint, std::vector<TraceEntry>& trace)
+{
+    if (checkpoint < 1 || checkpoint > m_Hashes.size())
+    {
+        ERROR("Checkpoint {} isn't in the recording (1 to {})", checkpoint, m_Hashes.size());
+        return false;
+    }
+    if (!Restore(checkpoint - 1))
+    {
+        ERROR("Couldn't read the keyframe before checkpoint {}", checkpoint);
+        return false;
+    }
+
+    long long mismatch = PlayTo(checkpoint - 1);
+    if (mismatch >= 0)
+    {
+        ERROR("Already differs at checkpoint {}, trace that one first", mismatch);
+        return false;
+    }
+
+    trace.clear();
+    for (quadword i = 0; i < m_Header.HashInterval; i++)
+    {
+        ApplyInputs();
+
+        TraceEntry entry = {};
+        entry.PC     = m_CPU->GetRegisters().PC.reg;
+        entry.Opcode = m_CPU->ReadMem(entry.PC);
+        bool running = m_CPU->Run(1);
+        m_Instructions++;
+        m_Hash = m_CPU->HashState(m_Hash);
+        entry.Hash   = m_Hash;
+        trace.push_back(entry);
+
+        if (!running)
+            break;
+    }
+    return true;
+}
+
+bool Replayer::WriteTrace(const std::string fileName, quadword checkpoint, const std::vector<TraceEntry>& trace) const
+{
+    FILE* fp = fopen(fileName.c_str(), "wb");
+    if (fp == NULL)
+    {
+        perror("Trace Open Failed:");
+        return false;
+    }
+
+    quadword count = trace.size();
+    fwrite(&checkpoint, sizeof(checkpoint), 1, fp);
+    fwrite(&count, sizeof(count), 1, fp);
+    fwrite(trace.data(), sizeof(TraceEntry), count, fp);
+    fclose(fp);
+
+    INFO("Wrote {} instructions before checkpoint {} to {}", count, checkpoint, fileName);
+    return true;
+}
+
+long long Replayer::Compare(const std::string fileName, quadword checkpoint, const std::vector<TraceEntry>& trace) const
+{
+    FILE* fp = fopen(fileName.c_str(), "rb");
+    if (fp == NULL)
+    {
+        perror("Trace Open Failed:");
+        return -1;
+    }
+
+    quadword traced, count;
+    bool valid = fread(&traced, sizeof(traced), 1, fp) == 1 && fread(&count, sizeof(count), 1, fp) == 1;
+    std::vector<TraceEntry> reference(valid ? count : 0);
+    valid = valid && fread(reference.data(), sizeof(TraceEntry), count, fp) == count;
+    fclose(fp);
+
+    if (!valid || traced != checkpoint)
+    {
+        ERROR("{} isn't a trace of checkpoint {}", fileName, checkpoint);
+        return -1;
+    }
+
+    quadword base = (checkpoint - 1) * m_Header.HashInterval;
+    size_t common = std::min(trace.size(), reference.size());
+    for (size_t i = 0; i < common; i++)
+    {
+        const TraceEntry& ours   = trace[i];
+        const TraceEntry& theirs = reference[i];
+        if (ours.Hash == theirs.Hash && ours.PC == theirs.PC)
+            continue;
+
+        WARN("Diverged at instruction {} (checkpoint {} + {})", base + i, checkpoint - 1, i);
+        if (ours.PC != theirs.PC || ours.Opcode != theirs.Opcode)
+            WARN("  ran {:02X} at {:04X}, reference ran {:02X} at {:04X}", ours.Opcode, ours.PC, theirs.Opcode, theirs.PC);
+        else
+            WARN("  {:02X} at {:04X} left a different state behind", ours.Opcode, ours.PC);
+        return i;
+    }
+
+    if (trace.size() != reference.size())
+    {
+        WARN("Diverged at instruction {}: one side stopped there", base + common);
+        return common;
+    }
+
+    INFO("Trace of checkpoint {} matches", checkpoint);
+    return -1;
+}
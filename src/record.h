@@ -0,0 +1,176 @@
+#pragma once
+#include "cpu.h"
+
+#define RECORD_MAGIC                0x43524247      // "GBRC"
+#define RECORD_VERSION              1
+// Defaults, instructions per checkpoint and checkpoints per keyframe
+#define RECORD_HASH_INTERVAL        4096
+#define RECORD_KEYFRAME_INTERVAL    1024
+
+// Replayer::Run results other than a checkpoint number
+#define REPLAY_MATCHED              -1
+#define REPLAY_FAILED               -2
+
+/*
+  RECORDING:
+  Everything needed to play a run back exactly - the joypad whenever it
+  changed, stamped with the CPU cycle it changed on, and a rolling state hash
+  every HashInterval instructions (a checkpoint). Every KeyframeInterval
+  checkpoints a full snapshot goes in too, so a replay can start near any
+  point instead of from the beginning.
+
+  File layout is the header followed by tagged records in the order they
+  happened:
+    'I' RecordInput
+    'H' quadword hash of the next checkpoint
+    'K' RecordKeyframe, then the CPUState up to its memory pages, then each
+        private page in order
+*/
+enum RecordTags
+{
+    RECORD_INPUT    = 'I',
+    RECORD_HASH     = 'H',
+    RECORD_KEYFRAME = 'K'
+};
+
+typedef struct RecordHeader
+{
+    doubleword  Magic;
+    doubleword  Version;
+    doubleword  HashInterval;
+    doubleword  KeyframeInterval;
+    quadword    Cartridge;          // Hash of the ROM and initial RAM it was made with
+} RecordHeader;
+
+typedef struct RecordInput
+{
+    quadword    Cycles;
+    byte        Buttons;
+} RecordInput;
+
+typedef struct RecordKeyframe
+{
+    quadword    Checkpoint;
+    quadword    Hash;               // Rolling hash as of that checkpoint
+} RecordKeyframe;
+
+/*
+  RECORDER:
+  Frontend like RunAhead, runs one frame per call. The state hash is only
+  taken on checkpoints, in between the CPU runs at full speed.
+*/
+class Recorder
+{
+    public:
+                                    Recorder        (CPU* cpu);
+                                    ~Recorder       ();
+        bool                        Open            (const std::string fileName, const Cartridge& cartridge,
+                                                     int hashInterval, int keyframeInterval);
+        void                        Close           ();
+        bool                        Frame           (byte buttons);
+        void                        Report          () const;
+
+    private:
+        CPU*                        m_CPU;
+        FILE*                       m_File;
+        RecordHeader                m_Header;
+        CPUState                    m_State;
+
+        byte                        m_Buttons;
+        quadword                    m_Instructions;
+        quadword                    m_Checkpoints;
+        quadword                    m_Keyframes;
+        quadword                    m_Hash;
+        double                      m_Seconds;
+
+        void                        Checkpoint      ();
+        void                        WriteKeyframe   ();
+};
+
+/*
+  RANDOM INPUT:
+  Stand-in for a real joypad - holds a random set of buttons for a random
+  number of frames. The same seed always presses the same buttons.
+*/
+#define RANDOM_INPUT_MAX_HOLD   30
+
+class RandomInput
+{
+    public:
+                                    RandomInput     (quadword seed);
+        byte                        Next            ();
+
+    private:
+        quadword                    m_Random;
+        byte                        m_Buttons;
+        int                         m_Hold;
+};
+
+/*
+  REPLAYER:
+  Loads a recording (keyframes stay on disk until needed) and plays it back
+  on a CPU, comparing hashes at every checkpoint.
+
+  Bisecting a mismatch at checkpoint C:
+    1. Trace(C) on a build that matches the recording, saved with WriteTrace
+    2. Trace(C) on the build that doesn't, then Compare against that file
+  A trace starts from checkpoint C-1 (restored from the nearest keyframe and
+  replayed forward) and hashes the state after every single instruction, so
+  the first differing entry is the exact instruction that diverged.
+*/
+typedef struct TraceEntry
+{
+    quadword    Hash;               // State after the instruction
+    word        PC;                 // Where the instruction was
+    byte        Opcode;
+} TraceEntry;
+
+class Replayer
+{
+    public:
+                                    Replayer        (CPU* cpu);
+                                    ~Replayer       ();
+        bool                        Open            (const std::string fileName, const Cartridge& cartridge);
+
+        // Play the whole recording back, returns the first checkpoint whose hash
+        // doesn't match, REPLAY_MATCHED if they all did or REPLAY_FAILED if it
+        // couldn't start
+        long long                   Run             ();
+        void                        Report          () const;
+        bool                        Trace           (quadword checkpoint, std::vector<TraceEntry>& trace);
+        bool                        WriteTrace      (const std::string fileName, quadword checkpoint,
+                                                     const std::vector<TraceEntry>& trace) const;
+        // Returns the index of the first entry that differs from the file, -1 if none
+        long long                   Compare         (const std::string fileName, quadword checkpoint,
+                                                     const std::vector<TraceEntry>& trace) const;
+
+        quadword                    GetCheckpoints  () const { return m_Hashes.size(); }
+        quadword                    GetHashInterval () const { return m_Header.HashInterval; }
+
+    private:
+        CPU*                        m_CPU;
+        FILE*                       m_File;
+        RecordHeader                m_Header;
+        CPUState                    m_State;
+
+        std::vector<RecordInput>    m_Inputs;
+        std::vector<quadword>       m_Hashes;
+        std::vector<RecordKeyframe> m_Keyframes;
+        std::vector<long>           m_KeyframeOffsets;
+
+        // Playback position
+        quadword                    m_Checkpoint;
+        quadword                    m_Instructions;
+        quadword                    m_Hash;
+        size_t                      m_NextInput;
+
+        long long                   m_Mismatch;
+        double                      m_Seconds;
+
+        bool                        Restore         (quadword checkpoint);
+        long long                   PlayTo          (quadword checkpoint);
+        bool                        RunTo           (quadword instructions);
+        void                        ApplyInputs     ();
+};
+
+quadword HashCartridge(const Cartridge& cartridge);
@@ -0,0 +1,88 @@
+#include "runahead.h"
+#include <chrono>
+
+typedef std::chrono::steady_clock Clock;
+
+static double Elapsed(Clock::time_point start, Clock::time_point end)
+{
+    return std::chrono::duration<double, std::micro>(end - start).count();
+}
+
+RunAhead::RunAhead(CPU* cpu, int frames)
+{
+    m_CPU           = cpu;
+    m_Frames        = frames;
+    m_FrameCount    = 0;
+    m_BaseTime      = 0;
+    m_SnapshotTime  = 0;
+    m_AheadTime     = 0;
+}
+
+/*
+    Present one frame, returns false once the CPU stops
+*/
+bool RunAhead::Frame(byte buttons)
+{
+    m_CPU->SetJoypad(buttons);
+
+    // Without run-ahead the real frame is the one we show
+    if (m_Frames <= 0)
+    {
+        Clock::time_point start = Clock::now();
+        bool running = m_CPU->RunFrame(true);
+        m_BaseTime += Elapsed(start, Clock::now());
+        m_FrameCount++;
+        return running;
+    }
+
+    Clock::time_point start = Clock::now();
+    if (!m_CPU->RunFrame(false))
+        return false;
+
+    Clock::time_point base = Clock::now();
+    m_CPU->MarkState(m_State);
+    Clock::time_point saved = Clock::now();
+
+    // Only the real frame is heard, the ahead frames are thrown away
+    AudioSink* sink = m_CPU->GetAudioSink();
+    m_CPU->SetAudioSink(NULL);
+
+    bool running = true;
+    for (int i = 1; i < m_Frames && running; i++)
+        running = m_CPU->RunFrame(false);
+    if (running)
+        m_CPU->RunFrame(true);
+
+    m_CPU->SetAudioSink(sink);
+
+    Clock::time_point ahead = Clock::now();
+    m_CPU->RewindState(m_State);
+    Clock::time_point restored = Clock::now();
+
+    m_BaseTime      += Elapsed(start, base);
+    m_SnapshotTime  += Elapsed(base, saved) + Elapsed(ahead, restored);
+    m_AheadTime     += Elapsed(saved, ahead);
+    m_FrameCount++;
+
+    return true;
+}
+
+/*
+    Per-frame cost of run-ahead on top of the real frame
+*/
+void RunAhead::Report() const
+{
+    if (m_FrameCount == 0)
+        return;
+
+    double base     = m_BaseTime / m_FrameCount;
+    double snapshot = m_SnapshotTime / m_FrameCount;
+    double ahead    = m_AheadTime / m_FrameCount;
+
+    INFO("Run-ahead {} frame(s) over {} frames", m_Frames, m_FrameCount);
+    INFO("  base frame      {:.2f} us", base);
+    INFO("  save + restore  {:.2f} us", snapshot);
+    INFO("  ahead frames    {:.2f} us", ahead);
+    if (base > 0)
+        INFO("  added cost      {:.2f} us/frame ({:.1f}x base)", snapshot + ahead, (snapshot + ahead) / base);
+}
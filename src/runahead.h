@@ -0,0 +1,34 @@
+#pragma once
+#include "cpu.h"
+
+/*
+  RUN-AHEAD:
+  Hides input latency by emulating a few frames past the current one with the
+  latest input, showing that frame, then rewinding. Each presented frame costs
+  one snapshot, one restore and N extra hidden frames on top of the real one.
+  The restore only copies back pages the ahead frames wrote to.
+
+  Frame(input):
+    1. Run the real frame with the input, hidden
+    2. Save state
+    3. Run N-1 more hidden frames, then one rendered frame
+    4. Restore state
+*/
+class RunAhead
+{
+    public:
+                                    RunAhead        (CPU* cpu, int frames);
+        bool                        Frame           (byte buttons);
+        void                        Report          () const;
+
+    private:
+        CPU*                        m_CPU;
+        int                         m_Frames;
+        CPUState                    m_State;
+
+        // Measurement, all in microseconds
+        quadword                    m_FrameCount;
+        double                      m_BaseTime;
+        double                      m_SnapshotTime;
+        double                      m_AheadTime;
+};
@@ -0,0 +1,46 @@
+#pragma once
+#include <atomic>
+#include <stddef.h>
+
+/*
+  SPSC QUEUE:
+  Fixed size ring for exactly one producer thread and one consumer thread.
+  Neither side ever blocks or allocates, Push fails when full and Pop when
+  empty. Head and tail sit on their own cache lines so the two threads don't
+  fight over one.
+*/
+template <typename T, size_t N>
+class SPSCQueue
+{
+    static_assert((N & (N - 1)) == 0, "SPSCQueue size must be a power of two");
+
+    public:
+                                    SPSCQueue       () : m_Head(0), m_Tail(0) {}
+
+        // Producer side
+        bool                        Push            (const T& val)
+        {
+            size_t tail = m_Tail.load(std::memory_order_relaxed);
+            if (tail - m_Head.load(std::memory_order_acquire) == N)
+                return false;
+            m_Items[tail & (N - 1)] = val;
+            m_Tail.store(tail + 1, std::memory_order_release);
+            return true;
+        }
+
+        // Consumer side
+        bool                        Pop             (T& val)
+        {
+            size_t head = m_Head.load(std::memory_order_relaxed);
+            if (head == m_Tail.load(std::memory_order_acquire))
+                return false;
+            val = m_Items[head & (N - 1)];
+            m_Head.store(head + 1, std::memory_order_release);
+            return true;
+        }
+
+    private:
+        alignas(64) std::atomic<size_t> m_Head;
+        alignas(64) std::atomic<size_t> m_Tail;
+        alignas(64) T               m_Items[N];
+};
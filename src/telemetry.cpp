@@ -0,0 +1,221 @@
+#include "telemetry.h"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <chrono>
+
+static_assert(sizeof(TelemetrySlot) == 128, "TelemetrySlot should be two cache lines");
+static_assert(std::atomic<quadword>::is_always_lock_free, "Telemetry needs lock free 64-bit atomics");
+
+Telemetry::Telemetry()
+{
+    m_Region = NULL;
+    m_Slot   = NULL;
+}
+
+Telemetry::~Telemetry()
+{
+    Release();
+    if (m_Region)
+        munmap(m_Region, sizeof(TelemetryRegion));
+}
+
+bool Telemetry::Create(const std::string name)
+{
+    bool created = true;
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0 && errno == EEXIST)
+    {
+        created = false;
+        fd = shm_open(name.c_str(), O_RDWR, 0644);
+    }
+    if (fd < 0)
+    {
+        perror("Telemetry Open Failed:");
+        return false;
+    }
+
+    if (created && ftruncate(fd, sizeof(TelemetryRegion)) != 0)
+    {
+        perror("Telemetry Resize Failed:");
+        close(fd);
+        return false;
+    }
+
+    /*
+        Whoever created the region may not have sized it yet and touching the
+        mapping before then is a SIGBUS. If they died part way through it never
+        will be, so don't wait forever
+    */
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(TELEMETRY_JOIN_MS);
+    if (!created)
+    {
+        struct stat info;
+        while (fstat(fd, &info) == 0 && (size_t)info.st_size < sizeof(TelemetryRegion))
+        {
+            if (std::chrono::steady_clock::now() > deadline)
+            {
+                ERROR("Telemetry region {} was never set up, remove it from /dev/shm", name);
+                close(fd);
+                return false;
+            }
+            usleep(1000);
+        }
+    }
+
+    void* region = mmap(NULL, sizeof(TelemetryRegion), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (region == MAP_FAILED)
+    {
+        perror("Telemetry Map Failed:");
+        return false;
+    }
+    m_Region = (TelemetryRegion*)region;
+
+    // Fresh shared memory is zeroed, so only the header needs filling in
+    if (created)
+    {
+        m_Region->Version   = TELEMETRY_VERSION;
+        m_Region->SlotCount = TELEMETRY_SLOTS;
+        m_Region->Magic.store(TELEMETRY_MAGIC, std::memory_order_release);
+    }
+    else
+    {
+        while (m_Region->Magic.load(std::memory_order_acquire) != TELEMETRY_MAGIC)
+        {
+            if (std::chrono::steady_clock::now() > deadline)
+            {
+                ERROR("Telemetry region {} was never set up, remove it from /dev/shm", name);
+                munmap(m_Region, sizeof(TelemetryRegion));
+                m_Region = NULL;
+                return false;
+            }
+            usleep(1000);
+        }
+
+        if (m_Region->Version != TELEMETRY_VERSION)
+        {
+            ERROR("Telemetry region {} is a different version, remove it from /dev/shm", name);
+            munmap(m_Region, sizeof(TelemetryRegion));
+            m_Region = NULL;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool Telemetry::Attach(const std::string name)
+{
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd < 0)
+    {
+        perror("Telemetry Open Failed:");
+        return false;
+    }
+
+    // A region that hasn't been sized yet would SIGBUS on the first read
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(TelemetryRegion))
+    {
+        ERROR("Telemetry region {} isn't ready or is a different version", name);
+        close(fd);
+        return false;
+    }
+
+    void* region = mmap(NULL, sizeof(TelemetryRegion), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (region == MAP_FAILED)
+    {
+        perror("Telemetry Map Failed:");
+        return false;
+    }
+    m_Region = (TelemetryRegion*)region;
+
+    if (m_Region->Magic.load(std::memory_order_acquire) != TELEMETRY_MAGIC ||
+        m_Region->Version != TELEMETRY_VERSION)
+    {
+        ERROR("Telemetry region {} isn't ready or is a different version", name);
+        munmap(m_Region, sizeof(TelemetryRegion));
+        m_Region = NULL;
+        return false;
+    }
+
+    return true;
+}
+
+bool Telemetry::InUse(const TelemetrySlot& slot)
+{
+    pid_t pid = slot.Pid.load(std::memory_order_relaxed);
+    return pid != 0 && !(kill(pid, 0) != 0 && errno == ESRCH);
+}
+
+/*
+    Free slots and slots whose owner has died are up for grabs, the CAS on
+    Pid settles it when two emulators go for the same one
+*/
+TelemetrySlot* Telemetry::Claim()
+{
+    if (m_Slot)
+        return m_Slot;
+
+    quadword self = getpid();
+    for (int i = 0; i < TELEMETRY_SLOTS; i++)
+    {
+        TelemetrySlot* slot = &m_Region->Slots[i];
+        quadword pid = slot->Pid.load(std::memory_order_relaxed);
+        if (InUse(*slot))
+            continue;
+        if (!slot->Pid.compare_exchange_strong(pid, self, std::memory_order_relaxed))
+            continue;
+
+        // Whatever the last owner left behind isn't ours
+        slot->Instructions.store(0, std::memory_order_relaxed);
+        slot->Cycles.store(0, std::memory_order_relaxed);
+        slot->Frames.store(0, std::memory_order_relaxed);
+        slot->Interrupts.store(0, std::memory_order_relaxed);
+        slot->PC.store(0, std::memory_order_relaxed);
+        slot->KHz.store(0, std::memory_order_relaxed);
+        slot->BlockHits.store(0, std::memory_order_relaxed);
+        slot->BlockLookups.store(0, std::memory_order_relaxed);
+        slot->Updated.store(0, std::memory_order_relaxed);
+
+        m_Slot = slot;
+        return slot;
+    }
+    return NULL;
+}
+
+void Telemetry::Release()
+{
+    if (m_Slot)
+    {
+        m_Slot->Pid.store(0, std::memory_order_relaxed);
+        m_Slot = NULL;
+    }
+}
+
+/*
+    Called from the emulation thread, a handful of relaxed stores
+*/
+void Telemetry::Publish(TelemetrySlot* slot, const CPUCounters& counters, word pc)
+{
+    quadword now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       std::chrono::steady_clock::now().time_since_epoch()).count();
+
+    // We're the only writer so the last published values are ours to read back
+    quadword lastCycles = slot->Cycles.load(std::memory_order_relaxed);
+    quadword lastTime   = slot->Updated.load(std::memory_order_relaxed);
+    if (lastTime && now > lastTime)
+        slot->KHz.store((counters.Cycles - lastCycles) * 1000000 / (now - lastTime), std::memory_order_relaxed);
+
+    slot->Instructions.store(counters.Instructions, std::memory_order_relaxed);
+    slot->Cycles.store(counters.Cycles, std::memory_order_relaxed);
+    slot->Frames.store(counters.Frames, std::memory_order_relaxed);
+    slot->Interrupts.store(counters.Interrupts, std::memory_order_relaxed);
+    slot->PC.store(pc, std::memory_order_relaxed);
+    slot->Updated.store(now, std::memory_order_relaxed);
+}
@@ -0,0 +1,76 @@
+#pragma once
+#include <atomic>
+#include "cpu.h"
+
+#define TELEMETRY_MAGIC     0x4D454C4554424755ULL   // "UGBTELEM"
+#define TELEMETRY_VERSION   2
+#define TELEMETRY_SLOTS     64
+#define TELEMETRY_NAME      "/gameboy-telemetry"
+#define TELEMETRY_JOIN_MS   250                     // How long to wait on another emulator setting the region up
+
+/*
+  TELEMETRY SLOT:
+  One per running CPU. Only the emulator writes a slot and every field is its
+  own relaxed atomic, so a monitor can read at any time without locks - each
+  value is consistent on its own, a set of them may straddle one publish.
+  Sized to two cache lines so neighbouring instances don't share any.
+  Pid is zero while the slot is free, owners clear it again on exit and slots
+  left behind by a process that died get taken over by the next Claim.
+*/
+typedef struct TelemetrySlot
+{
+    std::atomic<quadword>   Pid;
+    std::atomic<quadword>   Instructions;
+    std::atomic<quadword>   Cycles;
+    std::atomic<quadword>   Frames;
+    std::atomic<quadword>   Interrupts;
+    std::atomic<quadword>   PC;
+    // Emulated clock over the last publish interval
+    std::atomic<quadword>   KHz;
+    // Reserved for the block cache, zero until there is one
+    std::atomic<quadword>   BlockHits;
+    std::atomic<quadword>   BlockLookups;
+    // Steady clock nanoseconds at the last publish
+    std::atomic<quadword>   Updated;
+    quadword                Padding[6];
+} TelemetrySlot;
+
+/*
+  TELEMETRY REGION:
+  Layout of the shared memory object. Magic is stored last when the region
+  is created so readers can tell when it's ready.
+*/
+typedef struct TelemetryRegion
+{
+    std::atomic<quadword>   Magic;
+    doubleword              Version;
+    doubleword              SlotCount;
+    byte                    Padding[112];
+    TelemetrySlot           Slots[TELEMETRY_SLOTS];
+} TelemetryRegion;
+
+class Telemetry
+{
+    public:
+                                    Telemetry       ();
+                                    ~Telemetry      ();
+
+        // Emulator side, creates the region if nobody has yet
+        bool                        Create          (const std::string name);
+        // Monitor side, read only
+        bool                        Attach          (const std::string name);
+
+        // Grab a free slot for one CPU, NULL once they're all taken. It's given back
+        // by Release or when this object goes away
+        TelemetrySlot*              Claim           ();
+        void                        Release         ();
+        const TelemetryRegion*      GetRegion       () const { return m_Region; }
+
+        static void                 Publish         (TelemetrySlot* slot, const CPUCounters& counters, word pc);
+        // Slot has an owner that is still running
+        static bool                 InUse           (const TelemetrySlot& slot);
+
+    private:
+        TelemetryRegion*            m_Region;
+        TelemetrySlot*              m_Slot;
+};